@@ -0,0 +1,241 @@
+/*
+ * Phase timings for cidr-convert.
+ *
+ * Usage: bench [--engine=tree|trie|sort] [--fanout=0|8|16] [--collapse=eager|lazy] file
+ *        bench --run file command [arg ...]
+ *
+ * The first form builds cidr-convert's own code into this program
+ *  (the whole of cidr-convert.c is included, with its main renamed) so
+ *  that the phases can be timed separately on file:
+ *
+ *      read_input      reading and parsing the file into a fresh set,
+ *                      everything a real run does before output
+ *      add             adding the same addresses, ranges, and blocks
+ *                      to another fresh set, already parsed - for the
+ *                      tree engine, that's add_to_node and friends
+ *      normalize       for the tree engine, getting the tree ready to
+ *                      be walked: building any pending sorted input
+ *                      and, with --collapse=lazy, the collapsing pass
+ *                      that was put off while adding
+ *      walk            walking the set and formatting every block,
+ *                      which is dump_tree for the tree engine; the
+ *                      text goes to /dev/null.  The sort engine only
+ *                      sorts and merges when it's walked, so for it
+ *                      this is where most of the work is
+ *
+ *  and then one line is printed with those times (and the engine name
+ *  says which --collapse the tree used), the input lines per
+ *  second read_input managed, how many blocks came out, how many nodes
+ *  the tree or trie allocated (at most, at once), and the program's
+ *  peak RSS (which is bench's own, and so includes the parsed copy
+ *  of the input).  The second form just runs command with file on
+ *  stdin (and stdout thrown away), and reports its elapsed time and
+ *  peak RSS; that's for comparing whole programs, whatever they're
+ *  written in.
+ *
+ * Build with something like "cc -O2 -pthread -o bench bench.c"; see
+ *  run.sh for the whole suite.
+ *
+ * This file is in the public domain.
+ */
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define main cidr_convert_main
+#include "../cidr-convert.c"
+#undef main
+
+/*
+ * The add phase replays what the parser found, so first the file is
+ *  parsed into a list of it, by pointing the parser at an engine whose
+ *  "set" is the list - the same trick --lookup plays with its queries.
+ */
+typedef struct rec REC;
+
+struct rec {
+  unsigned long int a1;
+  unsigned long int a2;
+  int w;
+  } ;
+
+static REC *recs;
+static size_t nrecs;
+static size_t maxrecs;
+
+static void rec_add(unsigned long int a1, unsigned long int a2, int w)
+{
+ if (nrecs >= maxrecs)
+  { maxrecs = maxrecs ? maxrecs * 2 : 65536;
+    recs = realloc(recs,maxrecs*sizeof(REC));
+    if (recs == 0) nomem();
+  }
+ recs[nrecs].a1 = a1;
+ recs[nrecs].a2 = a2;
+ recs[nrecs].w = w;
+ nrecs ++;
+}
+
+static void rec_block(void *set, unsigned long int a, int w)
+{
+ rec_add(a,a,w);
+}
+
+static void rec_range(void *set, unsigned long int a1, unsigned long int a2)
+{
+ rec_add(a1,a2,-1);
+}
+
+static ENGINE rec_engine = { "record", 0, &rec_block, &rec_range };
+
+static void count_block(void *arg, unsigned long int v, int w)
+{
+ (*(size_t *)arg) ++;
+}
+
+static double now(void)
+{
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return(ts.tv_sec+(ts.tv_nsec/1e9));
+}
+
+static long int peak_rss(int who)
+{
+ struct rusage ru;
+
+ getrusage(who,&ru);
+ return(ru.ru_maxrss);
+}
+
+static void bench_phases(const char *file)
+{
+ ENGINE *e;
+ void *set;
+ double t0;
+ double t_read;
+ double t_add;
+ double t_norm;
+ double t_walk;
+ size_t nblocks;
+ size_t i;
+ long int nodes;
+
+ e = engine;
+ out.fd = open("/dev/null",O_WRONLY,0);
+ if (out.fd < 0)
+  { fprintf(stderr,"%s: /dev/null: %s\n",__progname,strerror(errno));
+    exit(1);
+  }
+ engine = &rec_engine;
+ read_file(file,0,0);
+ engine = e;
+ set = (*e->create)();
+ t0 = now();
+ read_file(file,set,0);
+ t_read = now() - t0;
+ (*e->destroy)(set);
+ set = (*e->create)();
+ t0 = now();
+ for (i=0;i<nrecs;i++)
+  { if (recs[i].w >= 0) (*e->add_block)(set,recs[i].a1,recs[i].w);
+    else if (e->add_range) (*e->add_range)(set,recs[i].a1,recs[i].a2);
+    else split_range(recs[i].a1,recs[i].a2,e->add_block,set);
+  }
+ t_add = now() - t0;
+ t0 = now();
+ if (e->create == &tree_create) tree_flush(set);
+ t_norm = now() - t0;
+ t0 = now();
+ (*e->walk)(set,out_fn,&out);
+ out_flush(&out);
+ t_walk = now() - t0;
+ nblocks = 0;
+ (*e->walk)(set,&count_block,&nblocks);
+ nodes = -1;
+ if (e->create == &tree_create) nodes = ((TREE *)set)->pool.used - FIRST_NODE;
+ else if (e->create == &trie_create) nodes = ((TRIE *)set)->pool.used - FIRST_NODE;
+ printf("%s %s%s: %lu lines, read_input %.3fs (%.0f lines/s), add %.3fs, ",
+   file,e->name,lazy_collapse?" (lazy)":"",(unsigned long int)nrecs,t_read,nrecs/(t_read>0?t_read:1e-9),t_add);
+ if (e->create == &tree_create) printf("normalize %.3fs, ",t_norm);
+ printf("walk %.3fs, %lu blocks, ",t_walk,(unsigned long int)nblocks);
+ if (nodes >= 0) printf("%ld nodes, ",nodes);
+ printf("peak RSS %ld kB\n",peak_rss(RUSAGE_SELF));
+ (*e->destroy)(set);
+}
+
+static void bench_run(const char *file, char **cmd)
+{
+ pid_t pid;
+ int status;
+ int fd;
+ int i;
+ double t0;
+ double t;
+
+ t0 = now();
+ pid = fork();
+ if (pid < 0)
+  { fprintf(stderr,"%s: fork: %s\n",__progname,strerror(errno));
+    exit(1);
+  }
+ if (pid == 0)
+  { fd = open(file,O_RDONLY,0);
+    if ((fd < 0) || (dup2(fd,0) < 0))
+     { fprintf(stderr,"%s: %s: %s\n",__progname,file,strerror(errno));
+       _exit(1);
+     }
+    fd = open("/dev/null",O_WRONLY,0);
+    if ((fd < 0) || (dup2(fd,1) < 0)) _exit(1);
+    execvp(cmd[0],cmd);
+    fprintf(stderr,"%s: %s: %s\n",__progname,cmd[0],strerror(errno));
+    _exit(1);
+  }
+ while (waitpid(pid,&status,0) < 0)
+  { if (errno != EINTR)
+     { fprintf(stderr,"%s: wait: %s\n",__progname,strerror(errno));
+       exit(1);
+     }
+  }
+ t = now() - t0;
+ if (! WIFEXITED(status) || WEXITSTATUS(status))
+  { fprintf(stderr,"%s: %s failed\n",__progname,cmd[0]);
+    exit(1);
+  }
+ printf("%s",file);
+ for (i=0;cmd[i];i++) printf(" %s",cmd[i]);
+ printf(": %.3fs, peak RSS %ld kB\n",t,peak_rss(RUSAGE_CHILDREN));
+}
+
+static void bench_usage(void)
+{
+ fprintf(stderr,"usage: %s [--engine=tree|trie|sort] [--fanout=0|8|16] [--collapse=eager|lazy] file\n       %s --run file command [arg ...]\n",__progname,__progname);
+ exit(1);
+}
+
+int main(int ac, char **av)
+{
+ int i;
+
+ if ((ac >= 4) && ! strcmp(av[1],"--run"))
+  { bench_run(av[2],av+3);
+    exit(0);
+  }
+ for (i=1;i<ac-1;i++)
+  { if (! strncmp(av[i],"--engine=",9)) set_engine(av[i]+9);
+    else if (! strncmp(av[i],"--fanout=",9))
+     { fanout = num_arg(av[i]+9,0,16);
+       if (fanout % 8) bench_usage();
+     }
+    else if (! strcmp(av[i],"--collapse=eager")) lazy_collapse = 0;
+    else if (! strcmp(av[i],"--collapse=lazy")) lazy_collapse = 1;
+    else break;
+  }
+ if ((i != ac-1) || engine->streams) bench_usage();
+ if (lazy_collapse && (engine->create != &tree_create)) bench_usage();
+ bench_phases(av[i]);
+ exit(0);
+}
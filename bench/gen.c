@@ -0,0 +1,213 @@
+/*
+ * Synthetic input for benchmarking cidr-convert (and cidr-convert.go).
+ *
+ * Usage: gen [-n count] [-s seed] [--sorted] kind
+ *
+ * Prints count lines (default 1000000), one token per line, in the
+ *  subset of the input syntax that both implementations accept: a
+ *  bare address, an address/width block, or an a-b range.  kind says
+ *  what they look like:
+ *
+ *      uniform         /32s chosen uniformly from the whole space -
+ *                      sparse, with next to nothing to collapse
+ *      clustered       a feed dominated by a few thousand /24s: most
+ *                      lines are addresses in one of them, some whole
+ *                      /24s or /2x blocks, a few strays elsewhere
+ *      ranges          long ranges, up to 2^24 addresses, that overlap
+ *                      each other heavily (never of just one address,
+ *                      which the Go version ignores)
+ *      alternating     every other address over a region, the worst
+ *                      case for collapsing: nothing ever merges, and
+ *                      the tree is as big as it can be for the input
+ *
+ * Lines come out in random order unless --sorted is given, in which
+ *  case they are sorted by starting address (as --sorted, in the C
+ *  version, requires).  The generator is its own PRNG (xorshift64*),
+ *  so a given seed gives the same output everywhere.
+ *
+ * Build with something like "cc -O2 -o gen gen.c".
+ *
+ * This file is in the public domain.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct item ITEM;
+
+struct item {
+  uint32_t a1;
+  uint32_t a2;
+  int w;
+  } ;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rnd(void)
+{
+ rng_state ^= rng_state >> 12;
+ rng_state ^= rng_state << 25;
+ rng_state ^= rng_state >> 27;
+ return((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/* A uniformly distributed number in [0,n). */
+static uint32_t rnd_below(uint32_t n)
+{
+ return(((uint64_t)rnd() * n) >> 32);
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"usage: gen [-n count] [-s seed] [--sorted] uniform|clustered|ranges|alternating\n");
+ exit(1);
+}
+
+static int cmp_item(const void *a, const void *b)
+{
+ const ITEM *x;
+ const ITEM *y;
+
+ x = a;
+ y = b;
+ if (x->a1 != y->a1) return((x->a1 < y->a1) ? -1 : 1);
+ if (x->a2 != y->a2) return((x->a2 < y->a2) ? -1 : 1);
+ return(0);
+}
+
+static void put_addr(uint32_t a)
+{
+ printf("%u.%u.%u.%u",a>>24,(a>>16)&0xff,(a>>8)&0xff,a&0xff);
+}
+
+static void gen_uniform(ITEM *v, size_t n)
+{
+ size_t i;
+
+ for (i=0;i<n;i++)
+  { v[i].a1 = rnd();
+    v[i].a2 = v[i].a1;
+    v[i].w = 32;
+  }
+}
+
+static void gen_clustered(ITEM *v, size_t n)
+{
+ uint32_t *nets;
+ size_t nn;
+ size_t i;
+ uint32_t r;
+ int w;
+
+ nn = (n / 250) + 1;
+ if (nn > 4000) nn = 4000;
+ nets = malloc(nn*sizeof(uint32_t));
+ if (nets == 0)
+  { fprintf(stderr,"gen: out of memory\n");
+    exit(1);
+  }
+ for (i=0;i<nn;i++) nets[i] = rnd() & 0xffffff00;
+ for (i=0;i<n;i++)
+  { r = rnd_below(100);
+    if (r < 85)
+     { v[i].a1 = nets[rnd_below(nn)] | rnd_below(256);
+       v[i].w = 32;
+     }
+    else if (r < 95)
+     { w = 24 + rnd_below(6);
+       v[i].a1 = (nets[rnd_below(nn)] | rnd_below(256)) & (0xffffffff << (32-w));
+       v[i].w = w;
+     }
+    else
+     { v[i].a1 = rnd();
+       v[i].w = 32;
+     }
+    v[i].a2 = v[i].a1 | (0xffffffff >> v[i].w);
+  }
+ free(nets);
+}
+
+static void gen_ranges(ITEM *v, size_t n)
+{
+ size_t i;
+ uint32_t len;
+
+ for (i=0;i<n;i++)
+  { len = 1 + rnd_below((uint32_t)1 << (1 + rnd_below(24)));
+    v[i].a1 = rnd();
+    if (v[i].a1 > 0xffffffff - len) v[i].a1 = 0xffffffff - len;
+    v[i].a2 = v[i].a1 + len;
+    v[i].w = -1;
+  }
+}
+
+static void gen_alternating(ITEM *v, size_t n)
+{
+ size_t i;
+ uint32_t base;
+
+ base = rnd() & 0xf0000000;
+ for (i=0;i<n;i++)
+  { v[i].a1 = base + (uint32_t)(2 * i);
+    v[i].a2 = v[i].a1;
+    v[i].w = 32;
+  }
+}
+
+int main(int ac, char **av)
+{
+ ITEM *v;
+ ITEM tmp;
+ size_t n;
+ size_t i;
+ size_t j;
+ int sorted;
+ int k;
+
+ n = 1000000;
+ sorted = 0;
+ for (k=1;k<ac;k++)
+  { if (! strcmp(av[k],"-n") && (k+1 < ac)) n = strtoul(av[++k],0,10);
+    else if (! strcmp(av[k],"-s") && (k+1 < ac)) rng_state ^= strtoull(av[++k],0,10) * 0xbf58476d1ce4e5b9ULL;
+    else if (! strcmp(av[k],"--sorted")) sorted = 1;
+    else break;
+  }
+ if (k != ac-1) usage();
+ v = malloc((n?n:1)*sizeof(ITEM));
+ if (v == 0)
+  { fprintf(stderr,"gen: out of memory\n");
+    exit(1);
+  }
+ if (! strcmp(av[k],"uniform")) gen_uniform(v,n);
+ else if (! strcmp(av[k],"clustered")) gen_clustered(v,n);
+ else if (! strcmp(av[k],"ranges")) gen_ranges(v,n);
+ else if (! strcmp(av[k],"alternating")) gen_alternating(v,n);
+ else usage();
+ if (sorted)
+  { qsort(v,n,sizeof(ITEM),&cmp_item);
+  }
+ else
+  { for (i=n;i>1;i--)
+     { j = rnd_below(i);
+       tmp = v[i-1];
+       v[i-1] = v[j];
+       v[j] = tmp;
+     }
+  }
+ for (i=0;i<n;i++)
+  { put_addr(v[i].a1);
+    if (v[i].w < 0)
+     { putchar('-');
+       put_addr(v[i].a2);
+     }
+    else if (v[i].w < 32) printf("/%d",v[i].w);
+    putchar('\n');
+  }
+ if (fflush(stdout) || ferror(stdout))
+  { fprintf(stderr,"gen: write error\n");
+    exit(1);
+  }
+ exit(0);
+}
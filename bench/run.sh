@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# The benchmark suite: builds cidr-convert, bench and gen (and, if
+#  there's a Go toolchain, cidr-convert.go), generates each kind of
+#  input in both random and sorted order, and on each one times the
+#  phases of every engine with bench (and of the tree engine with
+#  --collapse=lazy as well as the default eager collapsing), then the
+#  whole C program (with --sorted too, where the input is sorted) and
+#  the Go one end to end.  The C and Go outputs are compared as well;
+#  they should be the same.
+#
+# Usage: sh run.sh [count]
+#
+# count is the number of lines in each input (default 1000000).  The
+#  programs and inputs go in $BENCH_DIR (default /tmp/cidr-bench); $CC
+#  and $CFLAGS are used for the C compiles, as usual.
+#
+# This file is in the public domain.
+
+set -e
+
+cd "`dirname "$0"`"
+N=${1:-1000000}
+D=${BENCH_DIR:-/tmp/cidr-bench}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+mkdir -p "$D"
+
+$CC $CFLAGS -pthread -o "$D/cidr-convert" ../cidr-convert.c
+$CC $CFLAGS -pthread -o "$D/bench" bench.c
+$CC $CFLAGS -o "$D/gen" gen.c
+GO=
+if command -v go > /dev/null 2>&1 && go build -o "$D/cidr-convert-go" ../cidr-convert.go
+then
+  GO="$D/cidr-convert-go"
+else
+  echo "no Go toolchain; skipping cidr-convert.go"
+fi
+
+for kind in uniform clustered ranges alternating
+do
+  for order in random sorted
+  do
+    f="$D/$kind-$order.txt"
+    if [ $order = sorted ]
+    then
+      "$D/gen" -n "$N" --sorted $kind > "$f"
+    else
+      "$D/gen" -n "$N" $kind > "$f"
+    fi
+    for engine in tree trie sort
+    do
+      "$D/bench" --engine=$engine "$f"
+    done
+    "$D/bench" --engine=tree --collapse=lazy "$f"
+    "$D/bench" --run "$f" "$D/cidr-convert"
+    if [ $order = sorted ]
+    then
+      "$D/bench" --run "$f" "$D/cidr-convert" --sorted
+    fi
+    if [ -n "$GO" ]
+    then
+      "$D/bench" --run "$f" "$GO"
+      "$D/cidr-convert" "$f" > "$D/c.out"
+      "$GO" < "$f" > "$D/go.out"
+      cmp -s "$D/c.out" "$D/go.out" || echo "$f: C and Go outputs differ"
+    fi
+  done
+done
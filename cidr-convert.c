@@ -2,7 +2,10 @@
  * CIDR block calculator.
  *
  * Takes a set of dotted-quad IP addresses, ranges, or CIDR blocks, on
- *  stdin; at EOF, prints a minimal set of CIDR ranges to stdout.
+ *  stdin or in the files named as arguments; at EOF, prints a minimal
+ *  set of CIDR ranges to stdout.  Each file is read as a separate
+ *  input (so a range can't start in one and end in the next), and
+ *  complaints about it are prefixed with its name; - means stdin.
  *
  * Input consists of a stream of dotted-quads, pairs of dotted-quads
  *  separated by a dash, or dotted-quads with /number widths after
@@ -11,17 +14,203 @@
  *  CIDR-style block.  It is not an error for an address to be
  *  specified in the input more than once.  Whitespace may appear
  *  anywhere except within a dotted-quad or CIDR width.  Characters
- *  other than digits, dots, dashes, and whitespace are errors.  If a
- *  number in a dotted-quad is greater than 255, or a CIDR width is
- *  greater than 32, or other syntax errors occur (such as too many
- *  dots without whitespace, dash, or slash) a complaint is printed and
- *  the dotted-quad, range, or block in which it appears is skipped.
+ *  other than digits, dots, dashes, and whitespace (and hex digits and
+ *  colons, in IPv6 addresses) are errors.  If a number in a dotted-quad
+ *  is greater than 255, or a CIDR width is greater than 32, or other
+ *  syntax errors occur (such as too many dots without whitespace, dash,
+ *  or slash) a complaint is printed and the dotted-quad, range, or
+ *  block in which it appears is skipped.
  *
  * Output consists of zero or more lines, each a dotted-quad/width CIDR
  *  net-with-mask, including all and only the addresses in the input.
  *  It will be a minimal set, in that no two blocks in the output can
  *  be collapsed without resorting to noncontiguous netmasks.
  *
+ * IPv6 addresses, ranges, and blocks (with widths up to 128) may be
+ *  mixed in with the IPv4 ones, written any way inet_pton accepts; a
+ *  token is IPv6 if it has a colon in it.  They're kept in a set of
+ *  their own and printed, in the canonical form of RFC 5952 (mixed
+ *  notation, as in ::ffff:192.0.2.1, for IPv4-mapped addresses and
+ *  64:ff9b::/96), after all the IPv4 blocks.  A range can't have one
+ *  end of each kind.  IPv6 is only taken when the output is text and
+ *  none of --combine, --exclude, --listen, --lookup, --max-blocks,
+ *  --save-state, --within, or --count is given; elsewhere it's
+ *  complained about and skipped.  It's never printed before EOF, even
+ *  with --sorted.
+ *
+ * Options:
+ *
+ *      --engine=tree|trie|sort
+ *              Choose how the input is stored while it's accumulated.
+ *              tree (the default) is the depth-32 binary tree described
+ *              below; trie is a path-compressed version of it, which
+ *              needs far less memory for sparse input; sort keeps a
+ *              flat array of intervals and sorts and merges them at
+ *              EOF, which is usually fastest for very large input.  The
+ *              output is the same whichever is used.
+ *
+ *      --sorted
+ *              Promise that the input is sorted by starting address,
+ *              and in return get each block printed as soon as no
+ *              later input could change it, using constant memory
+ *              however much input there is.  Input that turns out not
+ *              to be sorted is a fatal error.  -j is ignored.
+ *
+ *      --fanout=0|8|16
+ *              With the tree engine, index the top of the tree directly
+ *              by this many leading bits of the address (default 8),
+ *              rather than walking down to them from a single root.
+ *
+ *      -j jobs
+ *              Parse each file named as an argument with up to this
+ *              many threads, each working on its own part of the file
+ *              and building its own set, and then merge the sets.  The
+ *              output, and any complaints, are the same as without it.
+ *              stdin (and any other input that can't be mapped) is
+ *              always parsed by a single thread.  With the tree
+ *              engine, a large result is formatted by that many
+ *              threads too, each doing its own part of the tree.
+ *
+ *      --readers=n
+ *              Read the input files (and --exclude files) ahead with n
+ *              threads, all at once, each taking the next file not yet
+ *              taken, while they're parsed, in order, from what's been
+ *              read, so that waiting for slow storage overlaps the
+ *              parsing rather than adding to it.  At most a megabyte
+ *              of each file is read ahead.  The output, and any
+ *              complaints, are the same as without it, but the files
+ *              aren't mapped, so -j doesn't parse them in parallel.
+ *
+ *      --combine=union|intersect|xor
+ *              Read each file as a separate set, and print not their
+ *              union, as usual, but whichever of these is given: union,
+ *              the addresses in any of them; intersect, the addresses
+ *              in all of them; xor, the addresses in an odd number of
+ *              them (for two files, in one but not the other).  Only
+ *              the tree engine can do this.
+ *
+ *      --exclude=file
+ *              Read file (which may be - for stdin) the same way as the
+ *              input, and leave everything in it out of the output,
+ *              wherever it appears in the input.  May be given more
+ *              than once.  Only the tree engine can do this.
+ *
+ *      --listen=path
+ *              Instead of printing anything, start with the set in the
+ *              files named (or with nothing, if there aren't any; stdin
+ *              isn't read) and keep it, taking commands to change it,
+ *              and to send it back, on a Unix-domain socket at path.
+ *              See the comment on the daemon for the protocol.  Only
+ *              the tree engine can do this.
+ *
+ *      --lookup
+ *              Build the set from the files named (there must be at
+ *              least one), and then, rather than printing it, read
+ *              queries from stdin - anything the input could contain -
+ *              and print each one that is entirely within the set, one
+ *              per line, an address as itself, a block as a block, and
+ *              a range as a range.  The set is flattened into a table
+ *              that answers each query in a few memory accesses.
+ *
+ *      --max-blocks=n
+ *              Print at most n blocks, even if the minimal set has
+ *              more: while there are too many, the two neighbouring
+ *              blocks whose smallest enclosing block covers the fewest
+ *              addresses that weren't in the input are replaced by
+ *              that block.  How many such addresses were covered in
+ *              all is reported on stderr.  Can't be used with
+ *              --sorted, and IPv6 input isn't taken.
+ *
+ *      --within=block
+ *              Print only the part of the set inside block (which, like
+ *              --lookup's queries, can be anything the input could
+ *              contain), rather than all of it; a block of the set that
+ *              contains it comes out as block itself.  The tree engine
+ *              goes straight down to block without looking at the rest
+ *              of the set.  May be given more than once, in which case
+ *              each is printed in turn.
+ *
+ *      --count
+ *              Rather than printing blocks, print the number of
+ *              addresses in the set (inside --within's blocks, added
+ *              up, if it's given).  With the tree engine, every node
+ *              keeps a count of the addresses under it, so this takes
+ *              at most 32 steps for each block.
+ *
+ *              Neither of these can be used with --sorted, --listen,
+ *              --lookup, or --max-blocks, and IPv6 input isn't taken.
+ *
+ *      --max-mem=megabytes
+ *              Keep the tree's nodes to about this much memory (shared
+ *              among the -j jobs, if there are several): whenever the
+ *              tree grows past it, what it holds is written out to a
+ *              temporary file (in $TMPDIR, or /tmp) as a sorted run of
+ *              intervals and the tree starts again empty, and at EOF
+ *              the runs are merged into the minimal set.  For input
+ *              that doesn't collapse, and would otherwise need more
+ *              nodes than there's memory for.  Only the tree engine
+ *              can do this, and not with --combine, --exclude, or
+ *              --listen.
+ *
+ *      --save-state=file
+ *              Once the input has been read (and anything --exclude'd
+ *              taken out), save the set in file, as a binary snapshot
+ *              of the tree, before going on as usual.  IPv6 input isn't
+ *              taken, since it couldn't be saved.
+ *
+ *      --load-state=file
+ *              Start with the set saved in file, rather than with
+ *              nothing, and add the input to it.  The file is mapped
+ *              and used as it is, without being parsed or copied, so
+ *              this is far faster than reading the same set as text;
+ *              adding to it afterwards copies only the pages that
+ *              changes touch, and new nodes go in room mapped after
+ *              the file's, until that's full.  The file itself is
+ *              never changed.  The --fanout is the one it was saved
+ *              with.  A file saved by a different version, on a
+ *              machine with the other byte order, or damaged, is
+ *              refused.  It may be the same file as --save-state's.
+ *              Neither can be used with --combine or --max-mem, and
+ *              only the tree engine can do them.
+ *
+ *      --in-format=text|bin32|binrange
+ *              Read input (all of it, including --exclude files and
+ *              --lookup queries) as text, as described above, or as
+ *              raw binary records: bin32 is four-byte addresses, and
+ *              binrange eight-byte records, each the start and end of
+ *              a range.  -j only applies to text.
+ *
+ *      --out-format=text|binprefix
+ *              Print the blocks as text, as described above, or as raw
+ *              binary records, each five bytes: the address, and then
+ *              the width in a byte of its own.
+ *
+ *      --byte-order=big|little
+ *              The byte order of the addresses in binary records, in
+ *              and out; the default is the machine's own.
+ *
+ *      --collapse=eager|lazy
+ *              With the tree engine, whether to collapse nodes that
+ *              have filled up as each address goes in (eager, the
+ *              default), or to leave them and collapse the whole tree
+ *              in one pass at the end (lazy), which can be quicker for
+ *              a bulk load of many addresses and costs memory in the
+ *              meantime.  The output is the same either way; bench/
+ *              compares the two.
+ *
+ *      --stats
+ *              When it's all done, report on stderr how many lines and
+ *              bytes were read, how many addresses, ranges, and blocks
+ *              were found in them, and how long (wall-clock and CPU)
+ *              each phase of the run took, and, for the tree engine,
+ *              how many nodes were allocated, collapsed to ALL, and
+ *              freed, the most that all the trees held at once
+ *              between them, and how many there are at each depth.
+ *              Only in a build with -DSTATS.
+ *
+ * Build with something like "cc -O2 -pthread -o cidr-convert
+ *  cidr-convert.c".
+ *
  * Compile-time options:
  *
  *      -DNO_PROGNAME
@@ -29,42 +218,87 @@
  *              it shows up undefined at link time, try compiling with
  *              this turned on.
  *
+ *      -DNO_MAIN
+ *              Leave out main and everything only it uses, so the file
+ *              can be linked into another program, which uses the
+ *              library interface declared in cidr-convert.h.
+ *
+ *      -DSTATS
+ *              Keep the counts --stats reports.  Without it, none of
+ *              that is compiled in at all, so it costs nothing.
+ *
  * This file is in the public domain.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "cidr-convert.h"
 
 extern const char *__progname;
 #ifdef NO_PROGNAME
-const char *__progname;
+const char *__progname = "cidr-convert";
+#ifndef NO_MAIN
 int main(int, char **);
 int main_(int, char **);
-int main(int ac, char **av) { __progname = av[0]; return(main_()); }
+int main(int ac, char **av) { __progname = av[0]; return(main_(ac,av)); }
 #define main main_
 #endif
+#endif
 
 /*
  * We store the input as a binary tree.  Conceptually, the tree is a
  *  fully-populated depth-32 binary tree, with each leaf marked as
  *  either present or absent in the input.  Of course, that's a totally
  *  impractical representation.  What we actually do is to store that
- *  tree, but whenever a subtree has all its leaves absent, the pointer
- *  that would normally point to it is replaced with a NONE pointer; if
- *  a subtree has all its leaves present, an ALL pointer.  (Leaf
- *  pointers are always either NONE or ALL, according as the leaf in
- *  question is absent or present.)
+ *  tree, but whenever a subtree has all its leaves absent, the link
+ *  that would normally point to it is replaced with a NONE link; if a
+ *  subtree has all its leaves present, an ALL link.  (Leaf links are
+ *  always either NONE or ALL, according as the leaf in question is
+ *  absent or present.)
  *
  * This could probably be stored more efficiently by allowing a single
  *  C structure to represent multiple levels in the tree when there's
  *  only one non-NONE path down through those levels, but the
  *  additional code complexity isn't worth it.
  *
- * Since we don't have to store "up" pointers, we don't, and a node
- *  consists of nothing but two child pointers.  We use an array[2]
- *  rather than two separate struct elements because at one place it's
- *  convenient to use a computed index, which would otherwise need to
- *  be a ? : expression.
+ * Since we don't have to store "up" links, we don't, and a node
+ *  consists of two child links and a count of the addresses under it,
+ *  so that how much of a block is present can be answered by going
+ *  down to the block, rather than walking everything in it (see
+ *  tree_count).  We use an array[2] rather than two separate struct
+ *  elements because at one place it's convenient to use a computed
+ *  index, which would otherwise need to be a ? : expression.  The count
+ *  is only 32 bits, though the root of the whole tree covers 2^32
+ *  addresses; but a real node is never full (it would have collapsed
+ *  to ALL), so its count always fits, and the arithmetic on it is
+ *  modulo 2^32 anyway, so it comes out right even where a node is full
+ *  for a while (in a lazy tree, say) and is then collapsed.
+ *
+ * The links aren't pointers.  All NODEs live in one contiguous array,
+ *  nodes[], and a link is a 32-bit index into it.  That makes a NODE
+ *  twelve bytes instead of twenty-four on 64-bit machines, keeps the
+ *  tree packed together for the cache, and means the tree contains no
+ *  addresses, so it can be written out and read back as is.
  *
  * The reason for choosing this data structure is that it makes
  *  extracting CIDR netblocks - our desired output - trivial.  All we
@@ -73,209 +307,2547 @@ int main(int ac, char **av) { __progname = av[0]; return(main_()); }
  *  set consists of the address/mask values corresponding to the ALL
  *  nodes.  (We actually do the collapsing as we build the tree, rather
  *  than deferring it until everything's done.)
- *
- * We could use a nil pointer for NONE or ALL, but don't, if only for
- *  error checking.
  */
 
 typedef struct node NODE;
+typedef uint32_t NODEREF;
 
 struct node {
-  NODE *sub[2];
+  NODEREF sub[2];
+  uint32_t count;
+  } ;
+
+/*
+ * The NONE and ALL links.  These are simply the first two indices in
+ *  nodes[]; those two slots are never handed out, so no real NODE can
+ *  have either index.
+ */
+#define NONE 0
+#define ALL 1
+#define FIRST_NODE 2
+
+/*
+ * Node storage.  When the input is millions of scattered addresses we
+ *  build (and collapse) tens of millions of nodes, and going to malloc
+ *  for each of them costs more in header overhead and allocator churn
+ *  than the nodes themselves.  So each kind of node comes out of a
+ *  POOL, one contiguous array which we grow by doubling when it fills
+ *  up.  Nodes given back by pool_put go on a free list, threaded
+ *  through their first 32-bit word (sub[0], for both kinds of node we
+ *  have), and are handed out again before we grow the array; when
+ *  we're done, pool_release frees the whole array at once, which is far
+ *  cheaper than walking the tree.  Indices 0 and 1 are NONE and ALL
+ *  and are never handed out.  If limit isn't zero, the array isn't
+ *  grown past that many nodes unless it's full at that size, and
+ *  pool_reset gives every node back at once but keeps the array, for
+ *  the tree to start over in.  If map isn't nil, the array is part of
+ *  a private mapping of a saved state (see --load-state), map and
+ *  maplen being the whole mapping; that can't be realloc'd, so growing
+ *  it means copying it out to a malloc'd array first.
+ *
+ * Because the array can move when it grows, nobody may hold a pointer
+ *  into it across a call to pool_get; that's why everything here passes
+ *  NODEREFs around instead.
+ */
+typedef struct pool POOL;
+
+struct pool {
+  char *mem;
+  size_t size;
+  NODEREF used;
+  NODEREF alloc;
+  NODEREF free;
+  NODEREF limit;
+  char *map;
+  size_t maplen;
+  } ;
+
+static void nomem(void)
+{
+ fprintf(stderr,"%s: out of memory\n",__progname);
+ exit(1);
+}
+
+#define POOL_LINK(p,n) (*(NODEREF *)((p)->mem+((size_t)(n)*(p)->size)))
+
+static NODEREF pool_get(POOL *p)
+{
+ NODEREF n;
+ NODEREF new_alloc;
+ char *new_mem;
+
+ if (p->free != NONE)
+  { n = p->free;
+    p->free = POOL_LINK(p,n);
+    return(n);
+  }
+ if (p->used >= p->alloc)
+  { new_alloc = p->alloc ? p->alloc * 2 : 65536;
+    if (new_alloc <= p->alloc) new_alloc = 0xffffffff;
+    if (p->limit && (new_alloc > p->limit) && (p->limit > p->used)) new_alloc = p->limit;
+    if (p->map)
+     { new_mem = (p->used < new_alloc) ? malloc(new_alloc*p->size) : 0;
+       if (new_mem == 0) nomem();
+       memcpy(new_mem,p->mem,(size_t)p->used*p->size);
+       munmap(p->map,p->maplen);
+       p->map = 0;
+     }
+    else
+     { new_mem = (p->used < new_alloc) ? realloc(p->mem,new_alloc*p->size) : 0;
+       if (new_mem == 0) nomem();
+     }
+    p->mem = new_mem;
+    p->alloc = new_alloc;
+    if (p->used < FIRST_NODE) p->used = FIRST_NODE;
+  }
+ return(p->used++);
+}
+
+static void pool_put(POOL *p, NODEREF n)
+{
+ POOL_LINK(p,n) = p->free;
+ p->free = n;
+}
+
+static void pool_reset(POOL *p)
+{
+ if (p->used > FIRST_NODE) p->used = FIRST_NODE;
+ p->free = NONE;
+}
+
+static void pool_release(POOL *p)
+{
+ if (p->map) munmap(p->map,p->maplen);
+ else free(p->mem);
+ p->mem = 0;
+ p->map = 0;
+ p->used = 0;
+ p->alloc = 0;
+ p->free = NONE;
+}
+
+/*
+ * Output.  Every engine hands us its blocks in ascending address
+ *  order, one call per block; w is the width (the /number).  With
+ *  millions of blocks, printf's format parsing and locking add up, so
+ *  put_block formats lines itself: each octet (and the width) is
+ *  copied from a table of the decimal strings for 0-255, always four
+ *  bytes at a time so the copy is a single store, and the pointer is
+ *  then advanced by the string's real length.  Lines accumulate in an
+ *  OUTBUF, which is written out with write(2) when it's nearly full
+ *  and at the end.  A write error is fatal.  An OUTBUF that's to_mem
+ *  doesn't write at all; it collects everything in mem (mlen bytes of
+ *  it, in mmax allocated), for parallel output, or a --listen client,
+ *  to write out.
+ */
+typedef struct outbuf OUTBUF;
+
+struct outbuf {
+  int fd;
+  size_t len;
+  int to_mem;
+  char *mem;
+  size_t mlen;
+  size_t mmax;
+  char buf[65536];
+  } ;
+
+/* The longest line we ever produce, 255.255.255.255/32\n, is 19. */
+#define MAX_LINE 20
+
+static OUTBUF out = { 1 };
+
+static struct {
+  char s[4];
+  int len;
+  } dec[256];
+
+static void dec_init(void) __attribute__((__constructor__));
+static void dec_init(void)
+{
+ int i;
+
+ for (i=0;i<256;i++) dec[i].len = sprintf(&dec[i].s[0],"%d",i);
+}
+
+static void out_flush(OUTBUF *o)
+{
+ size_t done;
+ ssize_t r;
+
+ if (o->to_mem)
+  { if (o->mlen+o->len > o->mmax)
+     { o->mmax = (o->mmax + o->len) * 2;
+       o->mem = realloc(o->mem,o->mmax);
+       if (o->mem == 0) nomem();
+     }
+    memcpy(o->mem+o->mlen,&o->buf[0],o->len);
+    o->mlen += o->len;
+    o->len = 0;
+    return;
+  }
+ for (done=0;done<o->len;done+=r)
+  { r = write(o->fd,&o->buf[done],o->len-done);
+    if (r < 0)
+     { if (errno == EINTR)
+        { r = 0;
+          continue;
+        }
+       fprintf(stderr,"%s: write error: %s\n",__progname,strerror(errno));
+       exit(1);
+     }
+  }
+ o->len = 0;
+}
+
+#define PUT_DEC(p,i) (memcpy((p),&dec[(i)].s[0],4), (p) += dec[(i)].len)
+
+static char *put_quad(char *p, unsigned long int v)
+{
+ PUT_DEC(p,(v>>24)&0xff);
+ *p++ = '.';
+ PUT_DEC(p,(v>>16)&0xff);
+ *p++ = '.';
+ PUT_DEC(p,(v>>8)&0xff);
+ *p++ = '.';
+ PUT_DEC(p,v&0xff);
+ return(p);
+}
+
+static void put_block(OUTBUF *o, unsigned long int v, int w)
+{
+ char *p;
+
+ if (o->len > sizeof(o->buf)-MAX_LINE) out_flush(o);
+ p = put_quad(&o->buf[o->len],v);
+ *p++ = '/';
+ PUT_DEC(p,w);
+ *p++ = '\n';
+ o->len = p - &o->buf[0];
+}
+
+/*
+ * IPv6 addresses are 128 bits, which is what the compiler's 128-bit
+ *  integers are for.  put_block6 prints them the canonical way (RFC
+ *  5952): eight groups of lowercase hex without leading zeros, except
+ *  that the longest run of two or more all-zero groups (the first, if
+ *  there's a tie) is left out, leaving just its ::.  Blocks of
+ *  IPv4-mapped addresses (in ::ffff:0:0/96) and of the well-known
+ *  translation prefix (64:ff9b::/96) get the mixed notation section 5
+ *  recommends for them instead, six groups and then the last 32 bits
+ *  as a dotted quad, as in ::ffff:192.0.2.1/128.
+ */
+typedef __uint128_t ADDR6;
+
+/* The longest IPv6 line, eight groups of ffff and a /128, is 44. */
+#define MAX_LINE6 48
+
+#ifndef NO_MAIN
+static void put_block6(OUTBUF *o, ADDR6 v, int w)
+{
+ static const char hex[] = "0123456789abcdef";
+ unsigned int g[8];
+ char *p;
+ int ng;
+ int zs;
+ int zl;
+ int i;
+ int j;
+ int k;
+
+ if (o->len > sizeof(o->buf)-MAX_LINE6) out_flush(o);
+ for (i=7;i>=0;i--,v>>=16) g[i] = v & 0xffff;
+ ng = 8;
+ if ((w >= 96) && !g[2] && !g[3] && !g[4] &&
+     ((!g[0] && !g[1] && (g[5] == 0xffff)) || ((g[0] == 0x64) && (g[1] == 0xff9b) && !g[5]))) ng = 6;
+ zs = -1;
+ zl = 1;
+ for (i=0;i<ng;i=j+1)
+  { j = i;
+    while ((j < ng) && (g[j] == 0)) j ++;
+    if (j-i > zl)
+     { zs = i;
+       zl = j - i;
+     }
+  }
+ p = &o->buf[o->len];
+ for (i=0;i<ng;i++)
+  { if (i == zs)
+     { *p++ = ':';
+       if (i == 0) *p++ = ':';
+       i += zl - 1;
+       continue;
+     }
+    for (k=12;(k>0)&&!(g[i]>>k);k-=4) ;
+    for (;k>=0;k-=4) *p++ = hex[(g[i]>>k)&15];
+    if (i < ng-1) *p++ = ':';
+  }
+ if (ng == 6)
+  { if (p[-1] != ':') *p++ = ':';
+    p = put_quad(p,((unsigned long int)g[6]<<16)|g[7]);
+  }
+ *p++ = '/';
+ PUT_DEC(p,w);
+ *p++ = '\n';
+ o->len = p - &o->buf[0];
+}
+#endif
+
+/*
+ * Binary output, for --out-format=binprefix: each block is five bytes,
+ *  the address in the byte order given by --byte-order (by default,
+ *  the machine's own) and then the width.
+ */
+static int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+#ifndef NO_MAIN
+static void put_prefix(OUTBUF *o, unsigned long int v, int w)
+{
+ unsigned char *p;
+
+ if (o->len > sizeof(o->buf)-MAX_LINE) out_flush(o);
+ p = (unsigned char *) &o->buf[o->len];
+ if (little_endian)
+  { p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+  }
+ else
+  { p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+  }
+ p[4] = w;
+ o->len += 5;
+}
+#endif
+
+/*
+ * Engines report blocks by calling a BLOCKFN, passing along whatever
+ *  argument their caller supplied; out_block is the one that prints
+ *  them as text, and out_prefix the one that prints them in binary.
+ *  out_fn is whichever of them the output is to be in.  IPv6 blocks
+ *  go to a BLOCKFN6 instead, and are only ever printed as text.
+ */
+typedef void (*BLOCKFN)(void *, unsigned long int, int);
+typedef void (*BLOCKFN6)(void *, ADDR6, int);
+
+static void out_block(void *o, unsigned long int v, int w)
+{
+ put_block(o,v,w);
+}
+
+#ifndef NO_MAIN
+static void out_prefix(void *o, unsigned long int v, int w)
+{
+ put_prefix(o,v,w);
+}
+#endif
+
+#ifndef NO_MAIN
+static void out_block6(void *o, ADDR6 v, int w)
+{
+ put_block6(o,v,w);
+}
+#endif
+
+static BLOCKFN out_fn = &out_block;
+
+/*
+ * Statistics, for --stats.  These are only kept in a build with
+ *  -DSTATS; otherwise STAT(x) is nothing at all, and nor is anything
+ *  else here, so the hot paths are exactly as they would be without
+ *  it.  Each counter lives in whatever it counts the work of - a TREE,
+ *  a PARSER - rather than in one global, since -j has several of those
+ *  at work at once in different threads; they're added up as the
+ *  trees are merged and the files finished.
+ */
+#ifdef STATS
+#define STAT(x) ((void)(x))
+
+typedef struct tstats TSTATS;
+
+struct tstats {
+  unsigned long int allocs;
+  unsigned long int collapses;
+  unsigned long int frees;
+  } ;
+
+static void tstats_add(TSTATS *t, const TSTATS *f)
+{
+ t->allocs += f->allocs;
+ t->collapses += f->collapses;
+ t->frees += f->frees;
+}
+#else
+#define STAT(x) ((void)0)
+#endif
+
+/*
+ * A tree.  nodes always mirrors pool.mem, and is refreshed whenever
+ *  new_node might have moved it.  Each tree has a pool of its own, so
+ *  separate trees can be built at the same time by separate threads.
+ *  Where the tree's root would be, there's an array of them; see the
+ *  tree engine's entry points, below.  With --max-mem, some of what
+ *  the tree holds may be on disk, in runs; see tree_spill.
+ */
+#define MAX_RUNS 64
+
+typedef struct tree TREE;
+
+struct tree {
+  POOL pool;
+  NODE *nodes;
+  int fanout;
+  size_t nroots;
+  NODEREF *roots;
+  NODEREF max_nodes;
+  int nruns;
+  FILE *runs[MAX_RUNS];
+  int lazy;
+  int dirty;
+  int sorted;
+  int pending;
+  unsigned long int pstart;
+  unsigned long int pend;
+  size_t fslot;
+  int fdepth;
+  unsigned long int fprev;
+  NODEREF fpath[32];
+#ifdef STATS
+  TSTATS st;
+  long int held;
+#endif
   } ;
 
-/* The root of the tree. */
-static NODE *root;
+/*
+ * The one count that isn't the work of any one tree is the peak: with
+ *  -j there are several trees at once, each with a pool of its own,
+ *  and what matters is the most node slots they held between them.
+ *  So each tree remembers how many slots it has told stat_held about,
+ *  and stat_hold tells it about any change since, keeping stat_peak
+ *  as the most stat_held has ever been.  Slots on a free list still
+ *  count, since their memory is still held; it's only pool_reset and
+ *  pool_release that give any back.  This is called after anything
+ *  that can change pool.used, but only new_node does so often, and
+ *  only its fresh slots get as far as the atomics.
+ */
+#ifdef STATS
+static long int stat_held;
+static long int stat_peak;
+
+static void stat_hold(TREE *t)
+{
+ long int u;
+ long int h;
+ long int p;
+
+ u = (t->pool.used > FIRST_NODE) ? t->pool.used - FIRST_NODE : 0;
+ if (u == t->held) return;
+ h = __atomic_add_fetch(&stat_held,u-t->held,__ATOMIC_RELAXED);
+ t->held = u;
+ p = __atomic_load_n(&stat_peak,__ATOMIC_RELAXED);
+ while ((h > p) && ! __atomic_compare_exchange_n(&stat_peak,&p,h,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) ;
+}
+#endif
+
+static NODEREF new_node(TREE *t)
+{
+ NODEREF n;
+
+ n = pool_get(&t->pool);
+ STAT(t->st.allocs++);
+ STAT(stat_hold(t));
+ t->nodes = (NODE *) t->pool.mem;
+ t->nodes[n].sub[0] = NONE;
+ t->nodes[n].sub[1] = NONE;
+ t->nodes[n].count = 0;
+ return(n);
+}
+
+static void free_node(TREE *t, NODEREF n)
+{
+ pool_put(&t->pool,n);
+}
 
 /*
- * The NONE and ALL pointers.  I know of no portable way of generating
- *  distinctive NODE * values without actually allocating NODEs for
- *  them to point to, except for the nil pointer.  Fortunately, NODEs
- *  are small enough that statically allocating two isn't a big deal.
+ * The number of addresses (modulo 2^32) under link c, which is at
+ *  level bit (so an ALL there is 2^(bit+1) of them), and the count for
+ *  node n, at level bit, worked out from its children.  Everything that
+ *  builds a node from the bottom up finishes it with set_count; the
+ *  ones that go down from the top instead (add_to_node, build_block)
+ *  add what they added to every node on the way down.
  */
-static NODE none;
-#define NONE (&none)
-static NODE all;
-#define ALL (&all)
+#define LINK_COUNT(t,c,bit) (((c) == NONE) ? 0 : ((c) == ALL) ? (uint32_t)(1UL << ((bit)+1)) : (t)->nodes[(c)].count)
+
+static void set_count(TREE *t, NODEREF n, int bit)
+{
+ t->nodes[n].count = LINK_COUNT(t,t->nodes[n].sub[0],bit-1) + LINK_COUNT(t,t->nodes[n].sub[1],bit-1);
+}
 
 /*
  * Free a node and all nodes under it.  Useful when we're setting ALL
  *  at a point relatively far up in the tree (which happens if a range
  *  or block subsumes some already-entered individual addresses).
  */
-static void free_tree(NODE *n)
+static void free_tree(TREE *t, NODEREF n)
 {
  if ((n == NONE) || (n == ALL)) return;
- free_tree(n->sub[0]);
- free_tree(n->sub[1]);
- free(n);
-}
-
-/*
- * Add an address to a node.  Conceptually, you pass a node to this
- *  routine.  But since it may want to replace the node with ALL, it
- *  needs to actually be passed an additional level of pointer, NODE **
- *  instead of NODE *.  This has the convenient property that this
- *  routine can also handle replacing NONE nodes with real nodes.  a is
- *  the address being added.  bit says how far down in the tree this
- *  node is, or more accurately how far up; 31 corresponds to the root,
- *  0 to the last level of internal nodes, and -1 to leaves.  end is a
- *  value which describes how large a block is being added; it is -1 to
- *  add a single leaf (a /32), 0 to add a pair of addresses (a /31),
- *  etc.
- *
- * Algorithm: Recursive.  If the node is already ALL, everything we
- *  want to add is already present, so do nothing.  Otherwise, if we've
- *  reached the level at which we want to operate (bit <= end), free
- *  the subtree if it's not NONE (it can't be ALL; we already checked)
- *  and replace it with ALL, and we're done.  Otherwise, we have to
- *  walk down either the 0 link or the 1 link.  If this node is
- *  presently NONE, we have to create a real node; then we recurse down
- *  whichever branch of the tree corresponds to the appropriate bit of
- *  a.  After adding, we check, and if both our subtrees are ALL, we
- *  collapse this node into an ALL.  (If further collapsing is possible
- *  at the next level up, our caller will take care of it.)
- */
-static void add_to_node(NODE **np, unsigned long int a, int bit, int end)
-{
- NODE *n;
-
- n = *np;
- if (n == ALL) return;
- if (bit <= end)
-  { if (n != NONE) free_tree(n);
-    *np = ALL;
-    return;
+ free_tree(t,t->nodes[n].sub[0]);
+ free_tree(t,t->nodes[n].sub[1]);
+ free_node(t,n);
+ STAT(t->st.frees++);
+}
+
+/*
+ * Add an address, or a block, to slot i of a tree.  a is the address
+ *  being added, and end is a value which describes how large a block
+ *  it is, as a level in the tree: levels count how far up a node is,
+ *  31 being the top of the whole tree, 0 the last level of internal
+ *  nodes, and -1 the leaves, so end is -1 to add a single leaf (a /32),
+ *  0 to add a pair of addresses (a /31), etc.  The slot's root is at
+ *  level 31-fanout, and end must be below that; a block that fills a
+ *  slot or more is the caller's business.
+ *
+ * Algorithm: walk down from the root.  At each node, look at the link
+ *  for the appropriate bit of a.  If it's ALL, everything we want to
+ *  add is already present, so do nothing.  Otherwise, if it leads to
+ *  the level at which we want to operate (end), free the subtree if
+ *  it's not NONE and replace it with ALL, and we're done adding.
+ *  Otherwise, if it's NONE, create a real node there, and go on down
+ *  to it.  Having added, go back up: if both of a node's subtrees are
+ *  ALL, we collapse the node into an ALL in its parent's link, and
+ *  check the parent the same way, and so on, up to the slot.
+ *
+ * Going back up needs the nodes on the way down, so they're kept in
+ *  the tree, in fpath[]: fpath[k] is the node at level 31-fanout-k,
+ *  and there are fdepth of them, in slot fslot, for address fprev.
+ *  And since they're kept, they're kept for the next insert, too - the
+ *  finger.  Real input is strongly clustered (successive lines from a
+ *  log often share a /24, or at least a /16), and yet every insert
+ *  would otherwise start at the root and walk the same two or three
+ *  dozen levels as the one before.  Every node on the finger down to
+ *  the level of the highest bit in which a and fprev differ (found
+ *  with clz) is an ancestor of a too, so we start from the deepest of
+ *  those instead.  The path is also what gets the counts right: what
+ *  the new ALL adds, less whatever was already there, is added to
+ *  every node on it.  After collapsing, the finger is cut off where the
+ *  collapse stopped.  Anything else that might free or replace nodes
+ *  on it - a block wider than a slot, a range, a removal, a merge, a
+ *  spill - forgets it by setting fdepth to 0, and the next insert
+ *  starts from the root.
+ *
+ * In a lazy tree (--collapse=lazy) we don't go back up at all, and
+ *  just note that the tree is dirty; see normalize_node.
+ *
+ * As everywhere, nothing holds a pointer into nodes[] across new_node,
+ *  which may grow it out from under us.
+ */
+static void add_to_node(TREE *t, size_t i, unsigned long int a, int end)
+{
+ NODEREF n;
+ NODEREF c;
+ uint32_t delta;
+ int top;
+ int k;
+ int b;
+ int d;
+
+ a &= 0xffffffff;
+ top = 31 - t->fanout;
+ if ((t->fdepth > 0) && (t->fslot == i))
+  { k = (a == t->fprev) ? top : top - (31 - __builtin_clz((uint32_t)(a ^ t->fprev)));
+    if (k >= t->fdepth) k = t->fdepth - 1;
+    if (k >= top - end) k = top - end - 1;
+    n = t->fpath[k];
+  }
+ else
+  { n = t->roots[i];
+    if (n == ALL) return;
+    if (n == NONE)
+     { n = new_node(t);
+       t->roots[i] = n;
+     }
+    t->fslot = i;
+    k = 0;
+    t->fpath[0] = n;
   }
- if (n == NONE)
-  { n = malloc(sizeof(NODE));
-    n->sub[0] = NONE;
-    n->sub[1] = NONE;
-    *np = n;
+ t->fprev = a;
+ for (b=top-k;;b--)
+  { d = (a >> b) & 1;
+    c = t->nodes[n].sub[d];
+    if (c == ALL)
+     { t->fdepth = k + 1;
+       return;
+     }
+    if (b-1 <= end)
+     { delta = (uint32_t)(1UL << b) - LINK_COUNT(t,c,b-1);
+       free_tree(t,c);
+       t->nodes[n].sub[d] = ALL;
+       break;
+     }
+    if (c == NONE)
+     { c = new_node(t);
+       t->nodes[n].sub[d] = c;
+     }
+    t->fpath[++k] = c;
+    n = c;
   }
- add_to_node(&n->sub[(a>>bit)&1],a,bit-1,end);
- if ((n->sub[0] == ALL) && (n->sub[1] == ALL))
-  { free(n);
-    *np = ALL;
+ for (b=0;b<=k;b++) t->nodes[t->fpath[b]].count += delta;
+ if (t->lazy)
+  { t->dirty = 1;
+    t->fdepth = k + 1;
+    return;
+  }
+ while ((t->nodes[n].sub[0] == ALL) && (t->nodes[n].sub[1] == ALL))
+  { free_node(t,n);
+    STAT(t->st.collapses++);
+    if (--k < 0)
+     { t->roots[i] = ALL;
+       break;
+     }
+    n = t->fpath[k];
+    t->nodes[n].sub[(a>>(top-k))&1] = ALL;
   }
+ t->fdepth = k + 1;
 }
 
 /*
- * Dump output.  This dumps out whatever output is appropriate for a
- *  given NODE.  If the node is NONE, there's nothing under it, so
- *  don't do anything.  If it's ALL, we've found a CIDR block; print it
- *  and return.  Otherwise, we recurse, first down the 0 branch, then
- *  the 1 branch.  v is the address-so-far, maintained as part of the
- *  recursive calls.
- *
- * The abort() is a can't-happen; it indicates that we have a node
- *  that's not NONE or ALL at the bottom level of the tree, which is
- *  supposed to hold only leaves.
+ * Remove an address, or a block, from a node.  Conceptually, you pass
+ *  a node to this routine, but since it may want to replace the node
+ *  with NONE (or an ALL with a real node), it returns the link that
+ *  should take the node's place, and the caller stores that back
+ *  wherever it got the node from.  a and end are as for add_to_node,
+ *  and bit is the level of the node.  This is adding turned around:
+ *  NONE means there's nothing to remove, and at the block's own level
+ *  the whole subtree goes, leaving NONE.  An ALL node above that level
+ *  has to be split back into a real node with two ALL children before
+ *  we can remove from one side of it, and on the way back up, a node
+ *  left with two NONE children is freed and becomes NONE itself.  So
+ *  the tree stays exactly as collapsed as if the block had never been
+ *  added.
  */
-static void dump_tree(NODE *n, unsigned long int v, int bit)
+static NODEREF remove_from_node(TREE *t, NODEREF n, unsigned long int a, int bit, int end)
 {
- if (n == NONE) return;
+ NODEREF s;
+ int b;
+
+ if (n == NONE) return(NONE);
+ if (bit <= end)
+  { free_tree(t,n);
+    return(NONE);
+  }
  if (n == ALL)
-  { printf("%lu.%lu.%lu.%lu/%d\n",v>>24&0xff,(v>>16)&0xff,(v>>8)&0xff,v&0xff,31-bit);
-    return;
+  { n = new_node(t);
+    t->nodes[n].sub[0] = ALL;
+    t->nodes[n].sub[1] = ALL;
+  }
+ b = (a >> bit) & 1;
+ s = remove_from_node(t,t->nodes[n].sub[b],a,bit-1,end);
+ t->nodes[n].sub[b] = s;
+ if ((t->nodes[n].sub[0] == NONE) && (t->nodes[n].sub[1] == NONE))
+  { free_node(t,n);
+    return(NONE);
   }
- if (bit < 0) abort();
- dump_tree(n->sub[0],v,bit-1);
- dump_tree(n->sub[1],v|(1<<bit),bit-1);
+ set_count(t,n,bit);
+ return(n);
 }
 
 /*
- * Add one address.  Used when the input contains an unadorned
- *  dotted-quad.  All we need do is call add_to_node appropriately.
+ * Add the range a1-a2 to node n, which is at level bit and covers the
+ *  block starting at lo, returning what should replace n, as usual.
+ *  Splitting the range into blocks and adding each from the top would
+ *  walk the shared part of their paths over and over, for as many as
+ *  62 blocks; instead this goes down once, and wherever the range
+ *  covers a node's whole block it becomes ALL on the spot, so only the
+ *  two fringes - the paths to the ends of the range - are walked, and
+ *  only where the range is partial do we look at both children.  The
+ *  caller must make sure the range overlaps n's block.  Collapsing is
+ *  the same as in add_to_node.
  */
-static void save_one_addr(unsigned long int a)
+static NODEREF add_range_to_node(TREE *t, NODEREF n, unsigned long int a1, unsigned long int a2, unsigned long int lo, int bit)
 {
- add_to_node(&root,a,31,-1);
+ NODEREF s;
+ unsigned long int mid;
+
+ if (n == ALL) return(ALL);
+ if ((a1 <= lo) && (a2 >= (lo | (0xffffffffUL >> (31-bit)))))
+  { free_tree(t,n);
+    return(ALL);
+  }
+ if (n == NONE) n = new_node(t);
+ mid = lo + (1UL << bit);
+ if (a1 < mid)
+  { s = add_range_to_node(t,t->nodes[n].sub[0],a1,a2,lo,bit-1);
+    t->nodes[n].sub[0] = s;
+  }
+ if (a2 >= mid)
+  { s = add_range_to_node(t,t->nodes[n].sub[1],a1,a2,mid,bit-1);
+    t->nodes[n].sub[1] = s;
+  }
+ if ((t->nodes[n].sub[0] == ALL) && (t->nodes[n].sub[1] == ALL))
+  { free_node(t,n);
+    STAT(t->st.collapses++);
+    return(ALL);
+  }
+ set_count(t,n,bit);
+ return(n);
 }
 
 /*
- * Add a range of addresses.  This is used for the
- *  "10.20.30.40 - 10.20.32.77" style of input.  All we do is start at
- *  the bottom of the range and loop, each time computing the largest
- *  block that doesn't go below the bottom, shrinking it as far as
- *  necessary to ensure it doesn't go above the top, adding it, and
- *  moving the `bottom' value to just above the block.  Lather, rinse,
- *  repeat...until the whole range is covered.
+ * Copy the subtree s of tree f into tree t, returning the copy.
  */
-static void save_range(unsigned long int a1, unsigned long int a2)
+static NODEREF copy_tree(TREE *t, TREE *f, NODEREF s)
 {
- int bit;
- unsigned long int m;
- unsigned long int t;
+ NODEREF n;
+ NODEREF c;
 
- if (a1 > a2)
-  { fprintf(stderr,"%s: invalid range (ends reversed)\n",__progname);
-    return;
+ if ((s == NONE) || (s == ALL)) return(s);
+ n = new_node(t);
+ c = copy_tree(t,f,f->nodes[s].sub[0]);
+ t->nodes[n].sub[0] = c;
+ c = copy_tree(t,f,f->nodes[s].sub[1]);
+ t->nodes[n].sub[1] = c;
+ t->nodes[n].count = f->nodes[s].count;
+ return(n);
+}
+
+/*
+ * Union the subtree s of tree f into the subtree n of tree t, which
+ *  is at the same place in the tree (level bit), returning what should
+ *  replace n.  This is add_to_node with a whole subtree to add
+ *  instead of one block.  Either side being ALL settles things without
+ *  looking at the other side at all, as does s being NONE; n being
+ *  NONE means we need a copy of s; otherwise we union the two pairs of
+ *  children and collapse if that made them both ALL.  f isn't changed.
+ */
+static NODEREF union_tree(TREE *t, NODEREF n, TREE *f, NODEREF s, int bit)
+{
+ NODEREF c;
+
+ if ((n == ALL) || (s == NONE)) return(n);
+ if (s == ALL)
+  { free_tree(t,n);
+    return(ALL);
   }
- while (a1 <= a2)
-  { m = (a1 - 1) & ~a1;
-    while (a1+m > a2) m >>= 1;
-    for (bit=-1,t=m;t;bit++,t>>=1) ;
-    add_to_node(&root,a1,31,bit);
-    a1 += m+1;
+ if (n == NONE) return(copy_tree(t,f,s));
+ c = union_tree(t,t->nodes[n].sub[0],f,f->nodes[s].sub[0],bit-1);
+ t->nodes[n].sub[0] = c;
+ c = union_tree(t,t->nodes[n].sub[1],f,f->nodes[s].sub[1],bit-1);
+ t->nodes[n].sub[1] = c;
+ if ((t->nodes[n].sub[0] == ALL) && (t->nodes[n].sub[1] == ALL))
+  { free_node(t,n);
+    return(ALL);
   }
+ set_count(t,n,bit);
+ return(n);
 }
 
 /*
- * Add a CIDR-style block.  This matches our storage method so well
- *  it's just a single call to add_to_node.  The reason for the ?:
- *  operator is that C doesn't promise that << by 32 actually shifts;
- *  32-bit machines often use only the low five bits of the shift
- *  count.
+ * Subtract the subtree s of tree f from the subtree n of tree t, which
+ *  is at the same place in the tree (level bit), returning what should
+ *  replace n; this is to remove_from_node what union_tree is to
+ *  add_to_node.  Nothing on either side being there (n or s NONE)
+ *  settles it, leaving n as it is, and all of s being there settles it
+ *  the other way, leaving NONE.  Otherwise s is a real node, and we
+ *  have to look at both halves; if n is ALL, that's the one place we
+ *  have to split it, into a node with two ALL children.  If both
+ *  halves come back NONE, so does this.  f isn't changed.
  */
-static void save_cidr(unsigned long int a, int n)
+static NODEREF subtract_tree(TREE *t, NODEREF n, TREE *f, NODEREF s, int bit)
 {
- add_to_node(&root,n?a&0xffffffff&(0xffffffff<<(32-n)):0,31,31-n);
+ NODEREF c;
+
+ if ((n == NONE) || (s == NONE)) return(n);
+ if (s == ALL)
+  { free_tree(t,n);
+    return(NONE);
+  }
+ if (n == ALL)
+  { n = new_node(t);
+    t->nodes[n].sub[0] = ALL;
+    t->nodes[n].sub[1] = ALL;
+  }
+ c = subtract_tree(t,t->nodes[n].sub[0],f,f->nodes[s].sub[0],bit-1);
+ t->nodes[n].sub[0] = c;
+ c = subtract_tree(t,t->nodes[n].sub[1],f,f->nodes[s].sub[1],bit-1);
+ t->nodes[n].sub[1] = c;
+ if ((t->nodes[n].sub[0] == NONE) && (t->nodes[n].sub[1] == NONE))
+  { free_node(t,n);
+    return(NONE);
+  }
+ set_count(t,n,bit);
+ return(n);
 }
 
 /*
- * Read input.  Implementation is a simple state machine.
- *
- * State values for the various input syntaxes (a=10, b=11, etc):
- *
- * input     1 2 3 . 4 5 . 6 7 . 8 9       1 2 3 . 4 5 ...
- * state  1 1 2 2 2 3 4 4 5 6 6 7 8 8 9 9 9 2 2 2 3 4 4 ...
- *
- * input     1 2 3 . 4 5 . 6 7 . 8 9   -   1 1 . 2 2 . 3 3 . 4 4     ...
- * state  1 1 2 2 2 3 4 4 5 6 6 7 8 8 9 a a b b c d d e f f g h h 1 1 ...
- *
- * input     1 2 3 . 4 5 . 6 7 . 8 9   /   1 5     ...
- * state  1 1 2 2 2 3 4 4 5 6 6 7 8 8 9 i i j j 1 1 ...
- *
- * a holds the address being constructed (or, for states 9, i, j, the
- *  address just constructed); n holds the number being accumulated.
- *  a1 is used to hold the first address when a range is being read
- *  (the second address is accumulated into a).
- *
- * If an error occurs, n is set to -1, and further errors are
- *  suppressed; we stay this way until we begin a new dotted-quad, by
- *  entering state 2 from state 9 or by entering state 1 upon seeing
- *  whitespace in most other states.
+ * Combine any number of subtrees, all at the same place (level bit) in
+ *  their own trees, into a new subtree of tree t, returning it.  c[]
+ *  holds the nc subtrees, each with the tree it belongs to; what it
+ *  makes is their union, their intersection, or their symmetric
+ *  difference (everything in an odd number of them), according to op.
+ *  The space after c[] is scratch, enough for 33 more levels of nc
+ *  entries.
  *
- * The "default: abort();" cases are can't-happen firewalls.
+ * This walks all the inputs in lockstep, and stops as soon as the
+ *  NONE and ALL links settle things.  Any NONE settles an intersection
+ *  and any ALL a union, at once.  Otherwise the NONEs and ALLs are
+ *  dropped (though, for xor, an odd number of ALLs still inverts the
+ *  result, so one ALL is kept in the list to say so), and if that
+ *  leaves nothing, the answer is ALL or NONE; if it leaves one real
+ *  node, the answer is a copy of it, which copy_tree can make without
+ *  looking at anything else.  Only where two or more inputs have real
+ *  nodes do we have to go down both sides, building a node of our own
+ *  and collapsing it on the way back up, as add_to_node does.  So the
+ *  cost goes with the places where the inputs actually differ.
  */
-static void read_input(void)
+#define OP_UNION 0
+#define OP_INTERSECT 1
+#define OP_XOR 2
+
+typedef struct cref CREF;
+
+struct cref {
+  TREE *f;
+  NODEREF n;
+  } ;
+
+static NODEREF combine_node(TREE *t, CREF *c, int nc, int op, int bit)
 {
- unsigned long int a1;
- unsigned long int a;
- int line;
- int n;
- int c;
- int state;
+ CREF *d;
+ NODEREF n;
+ NODEREF r;
+ int nall;
+ int k;
+ int m;
+ int i;
+ int b;
 
- state = 1;
- line = 1;
- n = 0;
- while (1)
-  { c = getchar();
-    if (c == EOF) break;
-    switch (c)
-     { case '0': case '1': case '2': case '3': case '4':
+ for (nall=0,k=0,i=0;i<nc;i++)
+  { if (c[i].n == NONE)
+     { if (op == OP_INTERSECT) return(NONE);
+       continue;
+     }
+    if (c[i].n == ALL)
+     { if (op == OP_UNION) return(ALL);
+       nall ++;
+       continue;
+     }
+    c[k++] = c[i];
+  }
+ if (op != OP_XOR) nall = 0;
+ if (k == 0) return(((op == OP_INTERSECT) || (nall & 1)) ? ALL : NONE);
+ if ((k == 1) && !(nall & 1)) return(copy_tree(t,c[0].f,c[0].n));
+ d = c + nc;
+ n = new_node(t);
+ for (b=0;b<2;b++)
+  { for (m=0;m<k;m++)
+     { d[m].f = c[m].f;
+       d[m].n = c[m].f->nodes[c[m].n].sub[b];
+     }
+    if (nall & 1)
+     { d[m].f = 0;
+       d[m].n = ALL;
+       m ++;
+     }
+    r = combine_node(t,d,m,op,bit-1);
+    t->nodes[n].sub[b] = r;
+  }
+ if ((t->nodes[n].sub[0] == ALL) && (t->nodes[n].sub[1] == ALL))
+  { free_node(t,n);
+    return(ALL);
+  }
+ if ((t->nodes[n].sub[0] == NONE) && (t->nodes[n].sub[1] == NONE))
+  { free_node(t,n);
+    return(NONE);
+  }
+ set_count(t,n,bit);
+ return(n);
+}
+
+/*
+ * Dump output.  This dumps out whatever output is appropriate for a
+ *  given NODE.  If the node is NONE, there's nothing under it, so
+ *  don't do anything.  If it's ALL, we've found a CIDR block; hand it
+ *  to fn and go on.  Otherwise, we walk down, first the 0 branch, then
+ *  the 1 branch.  v is the address-so-far.
+ *
+ * This is a walk with an explicit stack rather than a recursion: we
+ *  take a node off the stack, and if it's a real node, push its 1
+ *  branch and then its 0 branch, so the 0 branch comes off first.
+ *  Only the pending 1 branches, at most one per level, stay on the
+ *  stack, so 33 entries is always enough.
+ *
+ * The abort() is a can't-happen; it indicates that we have a node
+ *  that's not NONE or ALL at the bottom level of the tree, which is
+ *  supposed to hold only leaves.
+ */
+static void dump_tree(TREE *t, NODEREF n, unsigned long int v, int bit, BLOCKFN fn, void *arg)
+{
+ struct {
+   NODEREF n;
+   unsigned long int v;
+   int bit;
+   } stack[33];
+ int sp;
+
+ stack[0].n = n;
+ stack[0].v = v;
+ stack[0].bit = bit;
+ sp = 1;
+ while (sp > 0)
+  { sp --;
+    n = stack[sp].n;
+    v = stack[sp].v;
+    bit = stack[sp].bit;
+    if (n == NONE) continue;
+    if (n == ALL)
+     { (*fn)(arg,v,31-bit);
+       continue;
+     }
+    if (bit < 0) abort();
+    stack[sp].n = t->nodes[n].sub[1];
+    stack[sp].v = v | (1UL << bit);
+    stack[sp].bit = bit - 1;
+    stack[sp+1].n = t->nodes[n].sub[0];
+    stack[sp+1].v = v;
+    stack[sp+1].bit = bit - 1;
+    sp += 2;
+  }
+}
+
+/*
+ * The tree engine's entry points.
+ *
+ * The top of the tree is where every insert starts, and the top few
+ *  levels are nearly always fully populated anyway, so instead of a
+ *  single root we keep a direct-indexed array of them, roots[], one for
+ *  each value of the leading fanout bits of the address (0, 8, or 16;
+ *  --fanout sets it).  Each is the root of an ordinary subtree whose
+ *  top is at level 31-fanout; an insert goes straight to the right one
+ *  and saves that many levels of descent.  With fanout 0 there's just
+ *  the one root, as before.
+ *
+ * A block of width w is added by add_to_node at level 31-w, so a /32
+ *  goes all the way down to the leaves (-1); a block wider than a
+ *  slot simply sets every slot it covers to ALL.  The cost is that
+ *  collapsing can't go past the slots by itself, so walking has to put
+ *  the levels above them back: see tree_walk.  Removing a block works
+ *  the same way, with remove_from_node, or by setting slots to NONE.
+ *  Merging into an empty tree doesn't need to copy anything; we just
+ *  take the other tree over.
+ *
+ * max_nodes is the --max-mem budget, in nodes (0 if there isn't one).
+ *  After each insert, a tree that has more nodes than that is spilled
+ *  to disk; MAX_INSERT is the most nodes one insert can add, which the
+ *  pool is allowed beyond the budget so it need never double past it.
+ */
+static int fanout = 8;
+static NODEREF max_nodes = 0;
+static int lazy_collapse = 0;
+
+#define MAX_INSERT 64
+
+static void tree_spill(TREE *);
+static void tree_add_run(TREE *, FILE *);
+
+static void *tree_create(void)
+{
+ TREE *t;
+ size_t i;
+
+ t = malloc(sizeof(TREE));
+ if (t == 0) nomem();
+ t->pool.mem = 0;
+ t->pool.size = sizeof(NODE);
+ t->pool.used = 0;
+ t->pool.alloc = 0;
+ t->pool.free = NONE;
+ t->pool.limit = max_nodes ? max_nodes + MAX_INSERT : 0;
+ t->pool.map = 0;
+ t->nodes = 0;
+ t->fanout = fanout;
+ t->nroots = (size_t)1 << fanout;
+ t->roots = malloc(t->nroots*sizeof(NODEREF));
+ if (t->roots == 0) nomem();
+ for (i=0;i<t->nroots;i++) t->roots[i] = NONE;
+ t->max_nodes = max_nodes ? max_nodes : 0xffffffff;
+ t->nruns = 0;
+ t->lazy = lazy_collapse;
+ t->dirty = 0;
+ t->sorted = 1;
+ t->pending = 0;
+ t->fdepth = 0;
+ STAT(memset(&t->st,0,sizeof(t->st)));
+ STAT(t->held = 0);
+ return(t);
+}
+
+static void tree_destroy(void *set)
+{
+ TREE *t;
+ int i;
+
+ t = set;
+ for (i=0;i<t->nruns;i++) fclose(t->runs[i]);
+ pool_release(&t->pool);
+ STAT(stat_hold(t));
+ free(t->roots);
+ free(t);
+}
+
+#define SLOT(t,a) ((t)->fanout ? (a) >> (32-(t)->fanout) : 0)
+
+/*
+ * Bulk building, for input that comes in sorted.  Walking down from
+ *  the root for every insert repeats the same descent each time, and
+ *  allocates nodes that a later insert collapses straight away; but
+ *  if every interval starts at or after the one before, neither is
+ *  needed.  So a tree starts out "sorted", and while it stays that
+ *  way, add_block and add_range don't touch the nodes at all: like the
+ *  streaming engine, they keep one pending interval, [pstart,pend],
+ *  which grows while the input overlaps or abuts it.  Only when a gap
+ *  shows that it's finished is it built into the tree, by
+ *  build_block, one split_range block at a time, in ascending order.
+ *  Those blocks are maximal, and there's a gap before each pending
+ *  interval, so no block can ever join a neighbour: every node made is
+ *  one that survives, exactly as add_to_node would have left it, and
+ *  nothing is ever collapsed.  And since no block can go anywhere but
+ *  to the right of the last one, we keep the last one's path - the
+ *  finger, which add_to_node uses too - and the next block starts from
+ *  where it branches off that, the level of the highest bit in which
+ *  the two addresses differ, building only the new nodes below it.
+ *  Each node is made once and the path is all there is to hold, so a
+ *  sorted run is built bottom-up in time proportional to the nodes it
+ *  makes.
+ *
+ * The first interval that starts before the pending one builds the
+ *  pending one and turns "sorted" off for good, after which everything
+ *  is added the ordinary way.  So does anything that looks at
+ *  or changes the tree other than adding to it, by calling tree_flush.
+ *  tree_spill doesn't: it empties the tree, after which the next block
+ *  is simply the first.
+ */
+static void split_range(unsigned long int, unsigned long int, BLOCKFN, void *);
+
+static void build_block(void *set, unsigned long int v, int w)
+{
+ TREE *t;
+ NODEREF n;
+ NODEREF c;
+ size_t i;
+ int top;
+ int end;
+ int k;
+ int b;
+
+ t = set;
+ i = SLOT(t,v);
+ if (w <= t->fanout)
+  { for (k=(1<<(t->fanout-w));k>0;k--,i++) t->roots[i] = ALL;
+    t->fdepth = 0;
+    return;
+  }
+ top = 31 - t->fanout;
+ end = 31 - w;
+ if ((t->fdepth == 0) || (t->fslot != i))
+  { n = new_node(t);
+    t->roots[i] = n;
+    t->fslot = i;
+    k = 0;
+  }
+ else
+  { k = top - (31 - __builtin_clz((uint32_t)(v ^ t->fprev)));
+    n = t->fpath[k];
+  }
+ t->fpath[k] = n;
+ for (b=top-k;b-1>end;b--)
+  { c = new_node(t);
+    t->nodes[n].sub[(v>>b)&1] = c;
+    t->fpath[++k] = c;
+    n = c;
+  }
+ t->nodes[n].sub[(v>>b)&1] = ALL;
+ for (b=0;b<=k;b++) t->nodes[t->fpath[b]].count += (uint32_t)(1UL << (32-w));
+ t->fdepth = k + 1;
+ t->fprev = v;
+}
+
+/*
+ * Lazy collapsing, for --collapse=lazy.  A bulk load of millions of
+ *  addresses checks for a full node after every one of them, and most
+ *  of the time finds nothing to do; a lazy tree leaves full nodes as
+ *  they are while it's being added to, and then puts the whole tree
+ *  right at once, here, in one post-order pass: a node whose subtrees
+ *  both come back ALL becomes ALL itself.  That's the same collapsing
+ *  add_to_node would have done, so the tree comes out the same, only
+ *  later - and until it has, walking it would produce blocks that
+ *  ought to have been joined, so nothing but adding may look at a
+ *  dirty tree.  tree_flush sees to that (and tree_spill does too).
+ *  Ranges (add_range_to_node) still collapse as they go.
+ */
+static NODEREF normalize_node(TREE *t, NODEREF n, int bit)
+{
+ NODEREF s;
+
+ if ((n == NONE) || (n == ALL)) return(n);
+ s = normalize_node(t,t->nodes[n].sub[0],bit-1);
+ t->nodes[n].sub[0] = s;
+ s = normalize_node(t,t->nodes[n].sub[1],bit-1);
+ t->nodes[n].sub[1] = s;
+ if ((t->nodes[n].sub[0] == ALL) && (t->nodes[n].sub[1] == ALL))
+  { free_node(t,n);
+    STAT(t->st.collapses++);
+    return(ALL);
+  }
+ return(n);
+}
+
+static void tree_normalize(TREE *t)
+{
+ size_t i;
+
+ if (! t->dirty) return;
+ for (i=0;i<t->nroots;i++) t->roots[i] = normalize_node(t,t->roots[i],31-t->fanout);
+ t->dirty = 0;
+ t->fdepth = 0;
+}
+
+static void tree_flush(TREE *t)
+{
+ if (t->pending) split_range(t->pstart,t->pend,&build_block,t);
+ t->pending = 0;
+ t->sorted = 0;
+ tree_normalize(t);
+}
+
+/*
+ * Returns 0 if the tree isn't (or is no longer) sorted, and the
+ *  interval should be added the ordinary way.
+ */
+static int tree_add_sorted(TREE *t, unsigned long int a1, unsigned long int a2)
+{
+ if (t->pending)
+  { if (a1 < t->pstart)
+     { tree_flush(t);
+       if (t->pool.used > t->max_nodes) tree_spill(t);
+       return(0);
+     }
+    if (a1 <= t->pend+1)
+     { if (a2 > t->pend) t->pend = a2;
+       return(1);
+     }
+    split_range(t->pstart,t->pend,&build_block,t);
+    if (t->pool.used > t->max_nodes) tree_spill(t);
+  }
+ t->pending = 1;
+ t->pstart = a1;
+ t->pend = a2;
+ return(1);
+}
+
+/*
+ * The ?: is for the same reason as in save_cidr, below.
+ */
+static void tree_add_block(void *set, unsigned long int a, int w)
+{
+ TREE *t;
+ size_t i;
+ size_t n;
+
+ t = set;
+ if (t->sorted && tree_add_sorted(t,a,(w<32)?a|(0xffffffff>>w):a)) return;
+ i = SLOT(t,a&0xffffffff);
+ if (w > t->fanout)
+  { add_to_node(t,i,a,31-w);
+    if (t->pool.used > t->max_nodes) tree_spill(t);
+    return;
+  }
+ t->fdepth = 0;
+ for (n=(size_t)1<<(t->fanout-w);n>0;n--,i++)
+  { free_tree(t,t->roots[i]);
+    t->roots[i] = ALL;
+  }
+}
+
+/*
+ * A range goes to each slot it touches; those wholly inside it just
+ *  become ALL.
+ */
+static void tree_add_range(void *set, unsigned long int a1, unsigned long int a2)
+{
+ TREE *t;
+ size_t i;
+
+ t = set;
+ if (t->sorted && tree_add_sorted(t,a1,a2)) return;
+ t->fdepth = 0;
+ for (i=SLOT(t,a1);i<=SLOT(t,a2);i++)
+  { t->roots[i] = add_range_to_node(t,t->roots[i],a1,a2,t->fanout?(unsigned long int)i<<(32-t->fanout):0,31-t->fanout);
+    if (t->pool.used > t->max_nodes) tree_spill(t);
+  }
+}
+
+static void tree_remove_block(void *set, unsigned long int a, int w)
+{
+ TREE *t;
+ size_t i;
+ size_t n;
+
+ t = set;
+ tree_flush(t);
+ t->fdepth = 0;
+ i = SLOT(t,a&0xffffffff);
+ if (w >= t->fanout)
+  { t->roots[i] = remove_from_node(t,t->roots[i],a,31-t->fanout,31-w);
+    return;
+  }
+ for (n=(size_t)1<<(t->fanout-w);n>0;n--,i++)
+  { free_tree(t,t->roots[i]);
+    t->roots[i] = NONE;
+  }
+}
+
+static int tree_empty(TREE *t)
+{
+ size_t i;
+
+ for (i=0;i<t->nroots;i++)
+  { if (t->roots[i] != NONE) return(0);
+  }
+ return(1);
+}
+
+static void tree_merge(void *set, void *from)
+{
+ TREE *t;
+ TREE *f;
+ TREE tmp;
+ size_t i;
+ int j;
+
+ t = set;
+ f = from;
+ tree_flush(t);
+ tree_flush(f);
+ if (tree_empty(t))
+  { tmp = *t;
+    *t = *f;
+    *f = tmp;
+  }
+ else
+  { for (i=0;i<t->nroots;i++) t->roots[i] = union_tree(t,t->roots[i],f,f->roots[i],31-t->fanout);
+  }
+ t->fdepth = 0;
+ for (j=0;j<f->nruns;j++) tree_add_run(t,f->runs[j]);
+ f->nruns = 0;
+ if (t->pool.used > t->max_nodes) tree_spill(t);
+ STAT(tstats_add(&t->st,&f->st));
+ tree_destroy(f);
+}
+
+static void *tree_combine(void **sets, int n, int op)
+{
+ TREE *t;
+ CREF *c;
+ size_t i;
+ int j;
+
+ t = tree_create();
+ t->sorted = 0;
+ for (j=0;j<n;j++) tree_flush(sets[j]);
+ c = malloc(n*34*sizeof(CREF));
+ if (c == 0) nomem();
+ for (i=0;i<t->nroots;i++)
+  { for (j=0;j<n;j++)
+     { c[j].f = sets[j];
+       c[j].n = c[j].f->roots[i];
+     }
+    t->roots[i] = combine_node(t,c,n,op,31-t->fanout);
+  }
+ free(c);
+ for (j=0;j<n;j++)
+  { STAT(tstats_add(&t->st,&((TREE *)sets[j])->st));
+    tree_destroy(sets[j]);
+  }
+ return(t);
+}
+
+static void tree_subtract(void *set, void *from)
+{
+ TREE *t;
+ TREE *f;
+ size_t i;
+
+ t = set;
+ f = from;
+ tree_flush(t);
+ tree_flush(f);
+ t->fdepth = 0;
+ for (i=0;i<t->nroots;i++) t->roots[i] = subtract_tree(t,t->roots[i],f,f->roots[i],31-t->fanout);
+ STAT(tstats_add(&t->st,&f->st));
+ tree_destroy(f);
+}
+
+/*
+ * Walk n slots starting at roots[i] - always an aligned power of two
+ *  of them, n = 2^k - which make up the block v/fanout-k.  If they're
+ *  all ALL, that whole block is present, which is the collapse the
+ *  tree couldn't do for itself.  Otherwise, split the group in half,
+ *  until we get down to single slots, whose subtrees dump_tree walks.
+ */
+static void walk_slots(TREE *t, size_t i, size_t n, int k, BLOCKFN fn, void *arg)
+{
+ unsigned long int v;
+ size_t j;
+
+ v = (t->fanout ? (unsigned long int)i << (32-t->fanout) : 0);
+ for (j=0;(j<n)&&(t->roots[i+j]==ALL);j++) ;
+ if (j == n)
+  { (*fn)(arg,v,t->fanout-k);
+    return;
+  }
+ if (n == 1)
+  { dump_tree(t,t->roots[i],v,31-t->fanout,fn,arg);
+    return;
+  }
+ walk_slots(t,i,n/2,k-1,fn,arg);
+ walk_slots(t,i+(n/2),n/2,k-1,fn,arg);
+}
+
+/*
+ * Runs, for --max-mem.  When a tree grows past its budget, tree_spill
+ *  walks it, joining the blocks that walk finds into the maximal
+ *  intervals they make up, writes those to a temporary file - a run,
+ *  sorted and with no two intervals overlapping or touching - and then
+ *  empties the tree and starts over in the same memory.  So memory
+ *  stays within the budget however large and sparse the input is; the
+ *  disk holds the rest, eight bytes an interval.
+ *
+ * Walking a tree with runs spills what's in memory too, and then does
+ *  a k-way merge of the runs, with a heap keyed on each run's next
+ *  interval's start: an interval that overlaps or abuts the one being
+ *  built joins it, and anything else means that one is finished and
+ *  split_range (the same greedy decomposition save_range uses) turns
+ *  it into blocks.  Since nothing in a run can be revisited, there's
+ *  nothing to hold but one interval per run and the one being built.
+ *
+ * Each run is an open file, so there are at most MAX_RUNS; adding one
+ *  more merges all those there are into a single new run first.  The
+ *  files are unlinked as soon as they're made.
+ */
+typedef struct run RUN;
+
+struct run {
+  FILE *f;
+  uint32_t iv[2];
+  } ;
+
+typedef struct spill SPILL;
+
+struct spill {
+  FILE *f;
+  int any;
+  unsigned long int start;
+  unsigned long int end;
+  BLOCKFN fn;
+  void *arg;
+  } ;
+
+static void run_error(void)
+{
+ fprintf(stderr,"%s: temporary file: %s\n",__progname,strerror(errno));
+ exit(1);
+}
+
+static FILE *run_file(void)
+{
+ const char *dir;
+ char *path;
+ FILE *f;
+ int fd;
+
+ dir = getenv("TMPDIR");
+ if ((dir == 0) || (dir[0] == '\0')) dir = "/tmp";
+ path = malloc(strlen(dir)+sizeof("/cidr-convert.XXXXXX"));
+ if (path == 0) nomem();
+ sprintf(path,"%s/cidr-convert.XXXXXX",dir);
+ fd = mkstemp(path);
+ if (fd < 0)
+  { fprintf(stderr,"%s: %s: %s\n",__progname,path,strerror(errno));
+    exit(1);
+  }
+ unlink(path);
+ free(path);
+ f = fdopen(fd,"w+");
+ if (f == 0) run_error();
+ return(f);
+}
+
+static int run_next(RUN *r)
+{
+ if (fread(&r->iv[0],sizeof(r->iv),1,r->f) == 1) return(1);
+ if (ferror(r->f)) run_error();
+ return(0);
+}
+
+static void run_sift(RUN *h, int n, int i)
+{
+ RUN tmp;
+ int c;
+
+ while ((c = (2 * i) + 1) < n)
+  { if ((c+1 < n) && (h[c+1].iv[0] < h[c].iv[0])) c ++;
+    if (h[i].iv[0] <= h[c].iv[0]) return;
+    tmp = h[i];
+    h[i] = h[c];
+    h[c] = tmp;
+    i = c;
+  }
+}
+
+/*
+ * Merge n runs, calling fn on each maximal interval, in order.
+ */
+static void merge_runs(FILE **runs, int n, void (*fn)(void *, unsigned long int, unsigned long int), void *arg)
+{
+ RUN *h;
+ int nh;
+ int i;
+ int any;
+ unsigned long int start;
+ unsigned long int end;
+
+ h = malloc(n*sizeof(RUN));
+ if (h == 0) nomem();
+ for (nh=0,i=0;i<n;i++)
+  { if (fflush(runs[i]) || fseek(runs[i],0,SEEK_SET)) run_error();
+    h[nh].f = runs[i];
+    if (run_next(&h[nh])) nh ++;
+  }
+ for (i=(nh/2)-1;i>=0;i--) run_sift(h,nh,i);
+ any = 0;
+ start = 0;
+ end = 0;
+ while (nh > 0)
+  { if (any && (h[0].iv[0] <= end+1))
+     { if (h[0].iv[1] > end) end = h[0].iv[1];
+     }
+    else
+     { if (any) (*fn)(arg,start,end);
+       any = 1;
+       start = h[0].iv[0];
+       end = h[0].iv[1];
+     }
+    if (! run_next(&h[0])) h[0] = h[--nh];
+    run_sift(h,nh,0);
+  }
+ if (any) (*fn)(arg,start,end);
+ free(h);
+}
+
+static void spill_range(void *arg, unsigned long int a1, unsigned long int a2)
+{
+ SPILL *s;
+ uint32_t iv[2];
+
+ s = arg;
+ iv[0] = a1;
+ iv[1] = a2;
+ if (fwrite(&iv[0],sizeof(iv),1,s->f) != 1) run_error();
+}
+
+/*
+ * The ?: is for the same reason as in save_cidr, below.
+ */
+static void spill_block(void *arg, unsigned long int v, int w)
+{
+ SPILL *s;
+
+ s = arg;
+ if (s->any && (v == s->end+1))
+  { s->end = (w<32) ? v|(0xffffffff>>w) : v;
+    return;
+  }
+ if (s->any) spill_range(s,s->start,s->end);
+ s->any = 1;
+ s->start = v;
+ s->end = (w<32) ? v|(0xffffffff>>w) : v;
+}
+
+static void spill_split(void *arg, unsigned long int a1, unsigned long int a2)
+{
+ SPILL *s;
+
+ s = arg;
+ split_range(a1,a2,s->fn,s->arg);
+}
+
+static void tree_add_run(TREE *t, FILE *f)
+{
+ SPILL s;
+ int i;
+
+ if (t->nruns >= MAX_RUNS)
+  { s.f = run_file();
+    merge_runs(&t->runs[0],t->nruns,&spill_range,&s);
+    for (i=0;i<t->nruns;i++) fclose(t->runs[i]);
+    t->runs[0] = s.f;
+    t->nruns = 1;
+  }
+ t->runs[t->nruns++] = f;
+}
+
+static void tree_spill(TREE *t)
+{
+ SPILL s;
+ size_t i;
+
+ tree_normalize(t);
+ s.f = run_file();
+ s.any = 0;
+ walk_slots(t,0,t->nroots,t->fanout,&spill_block,&s);
+ if (s.any) spill_range(&s,s.start,s.end);
+ for (i=0;i<t->nroots;i++) t->roots[i] = NONE;
+ t->fdepth = 0;
+ pool_reset(&t->pool);
+ STAT(stat_hold(t));
+ tree_add_run(t,s.f);
+}
+
+static void tree_walk(void *set, BLOCKFN fn, void *arg)
+{
+ TREE *t;
+ SPILL s;
+
+ t = set;
+ tree_flush(t);
+ if (t->nruns == 0)
+  { walk_slots(t,0,t->nroots,t->fanout,fn,arg);
+    return;
+  }
+ if (! tree_empty(t)) tree_spill(t);
+ s.fn = fn;
+ s.arg = arg;
+ merge_runs(&t->runs[0],t->nruns,&spill_split,&s);
+}
+
+/*
+ * Range splitting and the path-compressed ("trie") engine are in
+ *  cidr-trie.h, written for any address width; here we instantiate
+ *  them twice, for IPv4 under their plain names (split_range, trie_add,
+ *  TRIE, and so on), and for IPv6 with a 6 on the end (split_range6,
+ *  trie_add6, TRIE6, ...).  The 128-bit bit scans are made of 64-bit
+ *  ones, since there are no builtins for them.
+ */
+static int clz128(ADDR6 x)
+{
+ return((x >> 64) ? __builtin_clzll((uint64_t)(x >> 64)) : 64 + __builtin_clzll((uint64_t)x));
+}
+
+static int ctz128(ADDR6 x)
+{
+ return((uint64_t)x ? __builtin_ctzll((uint64_t)x) : 64 + __builtin_ctzll((uint64_t)(x >> 64)));
+}
+
+#define W_NAME(x) x
+#define W_BITS 32
+#define W_KEY uint32_t
+#define W_ADDR unsigned long int
+#define W_FN BLOCKFN
+#define W_ONES 0xffffffffUL
+#define W_CLZ(x) __builtin_clz(x)
+#define W_CTZ(x) __builtin_ctzl(x)
+#define W_LOG2(x) (63 - __builtin_clzll((unsigned long long int)(x)))
+#include "cidr-trie.h"
+
+#define W_NAME(x) x##6
+#define W_BITS 128
+#define W_KEY ADDR6
+#define W_ADDR ADDR6
+#define W_FN BLOCKFN6
+#define W_ONES (~(ADDR6)0)
+#define W_CLZ(x) clz128(x)
+#define W_CTZ(x) ctz128(x)
+#define W_LOG2(x) (127 - clz128(x))
+#include "cidr-trie.h"
+
+/*
+ * The sort-and-merge engine.  When all the input arrives before any
+ *  output is wanted - which is always, here - we don't need a tree at
+ *  all.  Every address, range, and block simply goes into a flat array
+ *  of intervals, each packed into a uint64_t as start<<32|end; at EOF
+ *  we radix-sort them by start, merge overlapping and adjacent ones in
+ *  a single pass, and split each merged interval into blocks.  There's
+ *  no pointer chasing anywhere, and the cost is a few linear passes
+ *  over memory no matter how the input is distributed.  Merging two
+ *  sets is just appending one array to the other.
+ */
+typedef struct ivset IVSET;
+
+struct ivset {
+  uint64_t *v;
+  size_t n;
+  size_t max;
+  } ;
+
+static void *sort_create(void)
+{
+ IVSET *s;
+
+ s = malloc(sizeof(IVSET));
+ if (s == 0) nomem();
+ s->v = 0;
+ s->n = 0;
+ s->max = 0;
+ return(s);
+}
+
+static void sort_destroy(void *set)
+{
+ IVSET *s;
+
+ s = set;
+ free(s->v);
+ free(s);
+}
+
+static void sort_grow(IVSET *s, size_t n)
+{
+ uint64_t *new_v;
+ size_t new_max;
+
+ if (s->n+n <= s->max) return;
+ new_max = s->max ? s->max : 65536;
+ while (new_max < s->n+n) new_max *= 2;
+ new_v = realloc(s->v,new_max*sizeof(uint64_t));
+ if (new_v == 0) nomem();
+ s->v = new_v;
+ s->max = new_max;
+}
+
+static void sort_add_range(void *set, unsigned long int a1, unsigned long int a2)
+{
+ IVSET *s;
+
+ s = set;
+ if (s->n >= s->max) sort_grow(s,1);
+ s->v[s->n++] = ((uint64_t)(a1 & 0xffffffff) << 32) | (a2 & 0xffffffff);
+}
+
+/*
+ * The ?: is for the same reason as in save_cidr, below.
+ */
+static void sort_add_block(void *set, unsigned long int a, int w)
+{
+ sort_add_range(set,a,(w<32)?a|(0xffffffff>>w):a);
+}
+
+static void sort_merge(void *set, void *from)
+{
+ IVSET *s;
+ IVSET *f;
+
+ s = set;
+ f = from;
+ sort_grow(s,f->n);
+ memcpy(s->v+s->n,f->v,f->n*sizeof(uint64_t));
+ s->n += f->n;
+ sort_destroy(f);
+}
+
+/*
+ * LSD radix sort of v[0..n-1] on the start half, sixteen bits per
+ *  pass, using tmp (also n long) as scratch.  The result ends up back
+ *  in v.  A pass in which every value lands in the same bucket would
+ *  only copy, so if the array is already in that pass's order, we
+ *  skip it.
+ */
+static void radix_sort(uint64_t *v, uint64_t *tmp, size_t n)
+{
+ size_t *count;
+ uint64_t *v0;
+ uint64_t *t;
+ size_t i;
+ size_t sum;
+ size_t c;
+ int shift;
+
+ count = malloc(65536*sizeof(size_t));
+ if (count == 0) nomem();
+ v0 = v;
+ for (shift=32;shift<64;shift+=16)
+  { memset(count,0,65536*sizeof(size_t));
+    for (i=0;i<n;i++) count[(v[i]>>shift)&0xffff] ++;
+    if (count[(v[0]>>shift)&0xffff] == n) continue;
+    for (sum=0,i=0;i<65536;i++)
+     { c = count[i];
+       count[i] = sum;
+       sum += c;
+     }
+    for (i=0;i<n;i++) tmp[count[(v[i]>>shift)&0xffff]++] = v[i];
+    t = v;
+    v = tmp;
+    tmp = t;
+  }
+ if (v != v0) memcpy(v0,v,n*sizeof(uint64_t));
+ free(count);
+}
+
+static void sort_walk(void *set, BLOCKFN fn, void *arg)
+{
+ IVSET *s;
+ uint64_t *tmp;
+ size_t i;
+ unsigned long int start;
+ unsigned long int end;
+
+ s = set;
+ if (s->n == 0) return;
+ tmp = malloc(s->n*sizeof(uint64_t));
+ if (tmp == 0) nomem();
+ radix_sort(s->v,tmp,s->n);
+ free(tmp);
+ start = s->v[0] >> 32;
+ end = s->v[0] & 0xffffffff;
+ for (i=1;i<s->n;i++)
+  { if ((s->v[i] >> 32) > end+1)
+     { split_range(start,end,fn,arg);
+       start = s->v[i] >> 32;
+       end = s->v[i] & 0xffffffff;
+     }
+    else if ((s->v[i] & 0xffffffff) > end)
+     { end = s->v[i] & 0xffffffff;
+     }
+  }
+ split_range(start,end,fn,arg);
+}
+
+/*
+ * The streaming engine, for --sorted.  If the input is already in
+ *  order, there's no need to keep it: we hold one pending interval,
+ *  [start,end], and as each new interval arrives, either it overlaps
+ *  or abuts the pending one, which grows, or it's beyond it, and then
+ *  nothing later can touch the pending interval again, so we print it
+ *  and the new interval becomes pending.  That's O(1) memory however
+ *  much input there is.
+ *
+ * We can do better than waiting for a gap, too.  Splitting the pending
+ *  interval into blocks the way split_range does, any block that is
+ *  as large as its alignment allows is final - a larger end couldn't
+ *  change it - so every time the pending interval grows we print
+ *  blocks off its front until we reach one that had to be shrunk to
+ *  fit, and start becomes the first address not yet printed.  Output
+ *  thus follows input as closely as the input allows, which lets us
+ *  sit at the end of a pipe that never closes; to help with that,
+ *  read_fd flushes the output before each read.  (A lone address at
+ *  the end of what's been read so far isn't seen yet, though, since
+ *  the parser can't know it isn't the start of a range until the next
+ *  token arrives.)
+ *
+ * "Sorted" means sorted by the start of each address, range, or block.
+ *  If an interval starts before the previous one did, we may already
+ *  have printed something it should have been merged with, so that's
+ *  fatal.  walk prints only what's still pending, so it can be called
+ *  once, at the end.
+ */
+typedef struct stream STREAM;
+
+struct stream {
+  OUTBUF *o;
+  BLOCKFN fn;
+  int any;
+  unsigned long int last;
+  unsigned long int start;
+  unsigned long int end;
+  } ;
+
+static void *stream_create(void)
+{
+ STREAM *s;
+
+ s = malloc(sizeof(STREAM));
+ if (s == 0) nomem();
+ s->o = &out;
+ s->fn = out_fn;
+ s->any = 0;
+ s->last = 0;
+ return(s);
+}
+
+static void stream_destroy(void *set)
+{
+ free(set);
+}
+
+/*
+ * Print the blocks at the front of the pending interval that no later
+ *  input can change.  start may end up past end, meaning everything so
+ *  far has been printed; end is still kept, so that later input which
+ *  overlaps or abuts it is recognized as such.
+ */
+static void stream_final(STREAM *s)
+{
+ int k;
+
+ while (s->start <= s->end)
+  { k = (s->start & 0xffffffff) ? __builtin_ctzl(s->start) : 32;
+    if (s->start+(1UL<<k)-1 > s->end) return;
+    (*s->fn)(s->o,s->start,32-k);
+    s->start += 1UL << k;
+  }
+}
+
+static void stream_add_range(void *set, unsigned long int a1, unsigned long int a2)
+{
+ STREAM *s;
+
+ s = set;
+ if (a1 < s->last)
+  { out_flush(s->o);
+    fprintf(stderr,"%s: input is not sorted\n",__progname);
+    exit(1);
+  }
+ s->last = a1;
+ if (s->any && (a1 <= s->end+1))
+  { if (a2 <= s->end) return;
+    s->end = a2;
+  }
+ else
+  { if (s->any && (s->start <= s->end)) split_range(s->start,s->end,s->fn,s->o);
+    s->any = 1;
+    s->start = a1;
+    s->end = a2;
+  }
+ stream_final(s);
+}
+
+static void stream_add_block(void *set, unsigned long int a, int w)
+{
+ stream_add_range(set,a,(w<32)?a|(0xffffffff>>w):a);
+}
+
+static void stream_walk(void *set, BLOCKFN fn, void *arg)
+{
+ STREAM *s;
+
+ s = set;
+ if (s->any && (s->start <= s->end)) split_range(s->start,s->end,fn,arg);
+ s->start = s->end + 1;
+}
+
+/*
+ * The engines.  read_input doesn't care how the addresses are stored;
+ *  it calls save_one_addr, save_range, and save_cidr, and they in turn
+ *  call add_block, giving it the set being built (which create made,
+ *  and which only the engine looks inside), the address (with host
+ *  bits clear), and the width of a CIDR block.  An engine that would
+ *  rather have ranges whole provides add_range, and save_range uses
+ *  that instead of splitting them.  merge adds everything in the second
+ *  set to the first and destroys the second; an engine that can't
+ *  merge doesn't get parsed in parallel.  walk calls fn on every block
+ *  of the minimal set, in order, and destroy frees everything.  An
+ *  engine that streams prints output as it goes, rather than keeping
+ *  it all for walk.  An engine that can take blocks out of a set again
+ *  provides remove_block, which is called just like add_block; only
+ *  those can be used with --listen.  subtract is like merge, except
+ *  that it takes everything in the second set out of the first; only
+ *  engines with it can be used with --exclude.  combine makes a new set
+ *  from the union, intersection, or symmetric difference of n sets,
+ *  destroying them; only engines with it can be used with --combine.
+ */
+typedef struct engine ENGINE;
+
+struct engine {
+  const char *name;
+  void *(*create)(void);
+  void (*add_block)(void *, unsigned long int, int);
+  void (*add_range)(void *, unsigned long int, unsigned long int);
+  void (*merge)(void *, void *);
+  void (*walk)(void *, BLOCKFN, void *);
+  void (*destroy)(void *);
+  int streams;
+  void (*remove_block)(void *, unsigned long int, int);
+  void (*subtract)(void *, void *);
+  void *(*combine)(void **, int, int);
+  } ;
+
+static ENGINE engines[] = {
+ { "tree", &tree_create, &tree_add_block, &tree_add_range, &tree_merge, &tree_walk, &tree_destroy, 0, &tree_remove_block, &tree_subtract, &tree_combine },
+ { "trie", &trie_create, &trie_add_block, 0, &trie_merge, &trie_walk, &trie_destroy },
+ { "sort", &sort_create, &sort_add_block, &sort_add_range, &sort_merge, &sort_walk, &sort_destroy },
+ { "sorted", &stream_create, &stream_add_block, &stream_add_range, 0, &stream_walk, &stream_destroy, 1 },
+ { 0 } };
+
+static ENGINE *engine = &engines[0];
+
+/*
+ * The fast path for clean input.  Nearly every line we ever see is a
+ *  bare a.b.c.d or a.b.c.d/nn and nothing else, and for those the
+ *  state machine's byte-at-a-time switch is a lot of work.  fast_quad
+ *  looks at the 16 bytes starting at s with vector instructions: one
+ *  compare each finds the digits and the dots, which tells us whether
+ *  the token is a well-formed dotted-quad and where its fields are;
+ *  a shuffle (chosen from quad_shuf by the four field lengths) lines
+ *  the digits of each field up in its own 32-bit lane, and a couple
+ *  of multiply-adds turn each lane into its octet.  The token must
+ *  end in a single whitespace character, or in a / and a one- or
+ *  two-digit width and then whitespace.
+ *
+ * If anything at all is unusual - a field with more than three digits
+ *  or over 255, a width over 32, a range, a stray character, or fewer
+ *  than 16 bytes left in the block - fast_quad returns 0 and the state
+ *  machine handles it the slow way, so that everything it complains
+ *  about is still complained about in exactly the same words.
+ *  Otherwise it returns how many bytes it consumed, including the
+ *  terminating whitespace character, and fills in the address and
+ *  width (-1 for a bare address).
+ *
+ * This is built for x86 (SSSE3, checked for at run time, since it
+ *  isn't part of the baseline instruction set) and for 64-bit ARM
+ *  (whose NEON is always there).  Elsewhere there is no fast path.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FAST_QUAD
+#define FAST_QUAD_TARGET __attribute__((__target__("ssse3")))
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FAST_QUAD
+#define FAST_QUAD_TARGET
+#endif
+
+#ifdef FAST_QUAD
+
+static unsigned char quad_shuf[81][16];
+static int quad_ok;
+
+/*
+ * quad_shuf[i] is the shuffle for field lengths l0..l3 (each 1 to 3),
+ *  where i is (l0-1)*27+(l1-1)*9+(l2-1)*3+(l3-1).  Lane f of the
+ *  result holds field f's hundreds, tens, and units digits (missing
+ *  leading digits are zero) and then a zero byte.  An index with the
+ *  top bit set gives a zero byte on both architectures.
+ */
+static void quad_init(void) __attribute__((__constructor__));
+static void quad_init(void)
+{
+ int i;
+ int f;
+ int k;
+ int l;
+ int pos;
+
+ for (i=0;i<81;i++)
+  { memset(&quad_shuf[i][0],0x80,16);
+    for (pos=0,f=0;f<4;f++)
+     { l = ((i / (f == 0 ? 27 : f == 1 ? 9 : f == 2 ? 3 : 1)) % 3) + 1;
+       for (k=0;k<l;k++) quad_shuf[i][(f*4)+3-l+k] = pos + k;
+       pos += l + 1;
+     }
+  }
+#if defined(__x86_64__) || defined(__i386__)
+ quad_ok = __builtin_cpu_supports("ssse3");
+#else
+ quad_ok = 1;
+#endif
+}
+
+/*
+ * Given the digit and dot masks (bit i set if byte i is one), check
+ *  that the token at the front is digits and exactly three dots, each
+ *  field one to three digits long, and followed by something other
+ *  than a digit or dot within the 16 bytes.  Return its quad_shuf
+ *  index and set *lenp to its length, or return -1.
+ */
+static int quad_shape(unsigned int dm, unsigned int pm, int *lenp)
+{
+ unsigned int p[3];
+ int len;
+ int l0;
+ int l1;
+ int l2;
+ int l3;
+
+ len = __builtin_ctz(~(dm|pm));
+ if (len >= 16) return(-1);
+ pm &= (1U << len) - 1;
+ if (__builtin_popcount(pm) != 3) return(-1);
+ p[0] = __builtin_ctz(pm);
+ pm &= pm - 1;
+ p[1] = __builtin_ctz(pm);
+ pm &= pm - 1;
+ p[2] = __builtin_ctz(pm);
+ l0 = p[0];
+ l1 = p[1] - p[0] - 1;
+ l2 = p[2] - p[1] - 1;
+ l3 = len - p[2] - 1;
+ if (((unsigned int)(l0-1) > 2) || ((unsigned int)(l1-1) > 2) ||
+     ((unsigned int)(l2-1) > 2) || ((unsigned int)(l3-1) > 2)) return(-1);
+ *lenp = len;
+ return(((l0-1)*27)+((l1-1)*9)+((l2-1)*3)+(l3-1));
+}
+
+/*
+ * Check what follows a len-byte dotted-quad at s: whitespace, or a
+ *  width and then whitespace.  Return the total length consumed, or 0
+ *  if it's anything else.
+ */
+#define QUAD_WS(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\r') || ((c) == '\n'))
+#define QUAD_DIGIT(c) ((unsigned int)((c) - '0') < 10)
+
+static int quad_tail(const unsigned char *s, const unsigned char *end, int len, int *wp)
+{
+ int w;
+
+ if (QUAD_WS(s[len]))
+  { *wp = -1;
+    return(len+1);
+  }
+ if ((s[len] != '/') || (end-s < len+3) || !QUAD_DIGIT(s[len+1])) return(0);
+ w = s[len+1] - '0';
+ if (QUAD_WS(s[len+2]))
+  { *wp = w;
+    return(len+3);
+  }
+ if ((end-s < len+4) || !QUAD_DIGIT(s[len+2]) || !QUAD_WS(s[len+3])) return(0);
+ w = (w * 10) + (s[len+2] - '0');
+ if (w > 32) return(0);
+ *wp = w;
+ return(len+4);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+FAST_QUAD_TARGET
+static int fast_quad(const unsigned char *s, const unsigned char *end, unsigned long int *ap, int *wp)
+{
+ __m128i v;
+ __m128i d;
+ int len;
+ int i;
+ int k;
+
+ v = _mm_loadu_si128((const __m128i *)s);
+ d = _mm_sub_epi8(v,_mm_set1_epi8('0'));
+ i = quad_shape(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d,_mm_set1_epi8(9)),d)),
+                _mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_set1_epi8('.'))),&len);
+ if (i < 0) return(0);
+ k = quad_tail(s,end,len,wp);
+ if (k == 0) return(0);
+ d = _mm_shuffle_epi8(d,_mm_loadu_si128((const __m128i *)&quad_shuf[i][0]));
+ d = _mm_maddubs_epi16(d,_mm_setr_epi8(100,10,1,0,100,10,1,0,100,10,1,0,100,10,1,0));
+ d = _mm_madd_epi16(d,_mm_set1_epi16(1));
+ if (_mm_movemask_epi8(_mm_cmpgt_epi32(d,_mm_set1_epi32(255)))) return(0);
+ d = _mm_shuffle_epi8(d,_mm_setr_epi8(12,8,4,0,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1));
+ *ap = (uint32_t) _mm_cvtsi128_si32(d);
+ return(k);
+}
+
+#else
+
+/*
+ * NEON has no movemask, so we make one: keep one distinct bit per
+ *  byte and add up each half.
+ */
+static unsigned int neon_movemask(uint8x16_t m)
+{
+ static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+ uint8x16_t b;
+
+ b = vandq_u8(m,vld1q_u8(&bits[0]));
+ return(vaddv_u8(vget_low_u8(b)) | (vaddv_u8(vget_high_u8(b)) << 8));
+}
+
+static int fast_quad(const unsigned char *s, const unsigned char *end, unsigned long int *ap, int *wp)
+{
+ static const uint16_t weights[8] = { 100, 10, 1, 0, 100, 10, 1, 0 };
+ uint8x16_t v;
+ uint8x16_t d;
+ uint16x8_t lo;
+ uint16x8_t hi;
+ uint16x4_t o;
+ int len;
+ int i;
+ int k;
+
+ v = vld1q_u8(s);
+ d = vsubq_u8(v,vdupq_n_u8('0'));
+ i = quad_shape(neon_movemask(vcleq_u8(d,vdupq_n_u8(9))),neon_movemask(vceqq_u8(v,vdupq_n_u8('.'))),&len);
+ if (i < 0) return(0);
+ k = quad_tail(s,end,len,wp);
+ if (k == 0) return(0);
+ d = vqtbl1q_u8(d,vld1q_u8(&quad_shuf[i][0]));
+ lo = vmulq_u16(vmovl_u8(vget_low_u8(d)),vld1q_u16(&weights[0]));
+ hi = vmulq_u16(vmovl_high_u8(d),vld1q_u16(&weights[0]));
+ lo = vpaddq_u16(lo,hi);
+ o = vget_low_u16(vpaddq_u16(lo,lo));
+ if (vmaxv_u16(o) > 255) return(0);
+ *ap = ((unsigned long int)vget_lane_u16(o,0) << 24) | ((unsigned long int)vget_lane_u16(o,1) << 16) |
+       ((unsigned long int)vget_lane_u16(o,2) << 8) | vget_lane_u16(o,3);
+ return(k);
+}
+
+#endif
+#endif
+
+/*
+ * Parse input.  Implementation is a simple state machine.
+ *
+ * State values for the various input syntaxes (a=10, b=11, etc):
+ *
+ * input     1 2 3 . 4 5 . 6 7 . 8 9       1 2 3 . 4 5 ...
+ * state  1 1 2 2 2 3 4 4 5 6 6 7 8 8 9 9 9 2 2 2 3 4 4 ...
+ *
+ * input     1 2 3 . 4 5 . 6 7 . 8 9   -   1 1 . 2 2 . 3 3 . 4 4     ...
+ * state  1 1 2 2 2 3 4 4 5 6 6 7 8 8 9 a a b b c d d e f f g h h 1 1 ...
+ *
+ * input     1 2 3 . 4 5 . 6 7 . 8 9   /   1 5     ...
+ * state  1 1 2 2 2 3 4 4 5 6 6 7 8 8 9 i i j j 1 1 ...
+ *
+ * a holds the address being constructed (or, for states 9, i, j, the
+ *  address just constructed); n holds the number being accumulated.
+ *  a1 is used to hold the first address when a range is being read
+ *  (the second address is accumulated into a).
+ *
+ * If an error occurs, n is set to -1, and further errors are
+ *  suppressed; we stay this way until we begin a new dotted-quad, by
+ *  entering state 2 from state 9 or by entering state 1 upon seeing
+ *  whitespace in most other states.
+ *
+ * IPv6 goes through states of its own, 20 and up, in parse6:
+ *
+ * input     2 0 0 1 : d b 8 : : 1   -   2 0 0 1 : d b 8 : : 9     ...
+ * state  1 1 k k k k k k k k k k k l m m n n n n n n n n n n n 1 1 ...
+ *
+ * input     2 0 0 1 : d b 8 : :   /   4 8     ...
+ * state  1 1 k k k k k k k k k k l o o p p 1 1 ...
+ *
+ *  (k=20, l=21, and so on).  An address is collected whole into tok[]
+ *  and converted by inet_pton when it ends; a6 is the address just
+ *  converted, s6 the first one of a range, and n is the width and
+ *  the error flag, as before.  Which kind of address a token is can't
+ *  be told from its first character - 12 begins both 12::5 and
+ *  12.4.5.6 - so where an address could begin, in states 1, 9 and
+ *  10, a token that starts with a hex digit or a colon is scanned
+ *  ahead for a colon, which only IPv6 has.  If the token runs off the
+ *  end of the block before we can tell, it's stashed in tok[] in state
+ *  26 (q) until we can, and then either carried on with as IPv6 or
+ *  fed back through the IPv4 machine (with refeed set, so it isn't
+ *  scanned again) from the state it was found in, ustate.  IPv6
+ *  blocks go into set6, which is always a trie6; where there isn't
+ *  one, IPv6 input is complained about and skipped.
+ *
+ * The "default: abort();" cases are can't-happen firewalls.
+ *
+ * Complaints go through complain, which names the input file, if
+ *  there is one, after the program name, and writes to the PARSER's
+ *  err stream (unless that's nil), and counts them in errors.  The
+ *  PARSER also carries the set that the addresses it finds are added
+ *  to, or, if remove is set, removed from, and the engine that set
+ *  belongs to.
+ *
+ * Input arrives in blocks of whatever size the caller likes, so the
+ *  machine's variables live in a PARSER between calls: parse_block
+ *  runs the machine over one block, and parse_end handles EOF.
+ *  parse_block copies the PARSER into locals while it works, so the
+ *  compiler can keep them in registers.
+ *
+ * Input needn't be text, though; see parse_bin.  A PARSER always
+ *  knows which format it's reading, and parse_input and parse_end deal
+ *  with either.
+ */
+typedef struct parser PARSER;
+
+#define FMT_TEXT 0
+#define FMT_BIN32 1
+#define FMT_BINRANGE 2
+
+static int in_format = FMT_TEXT;
+
+struct parser {
+  unsigned long int a1;
+  unsigned long int a;
+  int line;
+  int n;
+  int state;
+  const char *name;
+  FILE *err;
+  ENGINE *e;
+  void *set;
+  int remove;
+  int errors;
+  int format;
+  int rlen;
+  unsigned char rec[8];
+  void *set6;
+  ADDR6 a6;
+  ADDR6 s6;
+  int ustate;
+  int refeed;
+  size_t toklen;
+  char tok[48];
+#ifdef STATS
+  unsigned long int saved[3];
+  unsigned char last;
+#endif
+  } ;
+
+static void parse_init(PARSER *p, const char *name, void *set)
+{
+ p->name = name;
+ p->err = stderr;
+ p->e = engine;
+ p->set = set;
+ p->remove = 0;
+ p->errors = 0;
+ p->format = in_format;
+ p->rlen = 0;
+ p->set6 = 0;
+ p->refeed = 0;
+ p->toklen = 0;
+ STAT(memset(&p->saved[0],0,sizeof(p->saved)));
+ STAT(p->last = 0);
+ p->a1 = 0;
+ p->a = 0;
+ p->state = 1;
+ p->line = 1;
+ p->n = 0;
+}
+
+static void complain(PARSER *p, const char *fmt, ...)
+{
+ va_list ap;
+
+ p->errors ++;
+ if (p->err == 0) return;
+ if (p->name) fprintf(p->err,"%s: %s: ",__progname,p->name);
+ else fprintf(p->err,"%s: ",__progname);
+ va_start(ap,fmt);
+ vfprintf(p->err,fmt,ap);
+ va_end(ap);
+}
+
+/*
+ * Add one address.  Used when the input contains an unadorned
+ *  dotted-quad.  All we need do is add it as a /32.  (This, and the
+ *  other two, remove instead if the PARSER says to.)
+ */
+static void save_one_addr(PARSER *p, unsigned long int a)
+{
+ STAT(p->saved[0]++);
+ (*(p->remove?p->e->remove_block:p->e->add_block))(p->set,a,32);
+}
+
+/*
+ * Add a range of addresses.  This is used for the
+ *  "10.20.30.40 - 10.20.32.77" style of input.  Unless the engine
+ *  takes ranges directly, we split it into blocks and add those.
+ */
+static void save_range(PARSER *p, unsigned long int a1, unsigned long int a2)
+{
+ STAT(p->saved[1]++);
+ if (a1 > a2)
+  { complain(p,"invalid range (ends reversed)\n");
+    return;
+  }
+ if (p->remove) split_range(a1,a2,p->e->remove_block,p->set);
+ else if (p->e->add_range) (*p->e->add_range)(p->set,a1,a2);
+ else split_range(a1,a2,p->e->add_block,p->set);
+}
+
+/*
+ * Add a CIDR-style block.  This matches our storage method so well
+ *  it's just a single call to add_block.  The reason for the ?:
+ *  operator is that C doesn't promise that << by 32 actually shifts;
+ *  32-bit machines often use only the low five bits of the shift
+ *  count.
+ */
+static void save_cidr(PARSER *p, unsigned long int a, int n)
+{
+ STAT(p->saved[2]++);
+ (*(p->remove?p->e->remove_block:p->e->add_block))(p->set,n?a&0xffffffff&(0xffffffff<<(32-n)):0,n);
+}
+
+/*
+ * Add an IPv6 block or range.  These are just like their IPv4
+ *  counterparts, except that they always add, to set6.
+ */
+static void save_cidr6(PARSER *p, ADDR6 a, int n)
+{
+ trie_add_block6(p->set6,n?a&(~(ADDR6)0<<(128-n)):0,n);
+}
+
+static void save_range6(PARSER *p, ADDR6 a1, ADDR6 a2)
+{
+ if (a1 > a2)
+  { complain(p,"invalid range (ends reversed)\n");
+    return;
+  }
+ split_range6(a1,a2,&trie_add_block6,p->set6);
+}
+
+#define TOK_WS(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\r') || ((c) == '\n'))
+#define TOK_DIGIT(c) ((unsigned int)((c) - '0') < 10)
+#define TOK_HEX(c) (TOK_DIGIT(c) || ((unsigned int)(((c) | 0x20) - 'a') < 6))
+#define TOK_CHAR6(c) (TOK_HEX(c) || ((c) == ':') || ((c) == '.'))
+
+/*
+ * Look ahead from s for a colon in the token starting there: 1 if
+ *  there is one, 0 if the token ends without one, and -1 if the block
+ *  ends first.
+ */
+static int v6_scan(const unsigned char *s, const unsigned char *end)
+{
+ for (;s<end;s++)
+  { if (*s == ':') return(1);
+    if (! TOK_CHAR6(*s)) return(0);
+  }
+ return(-1);
+}
+
+/*
+ * Convert the IPv6 address in tok[].  tok[] is one byte bigger than
+ *  the longest valid address, so a token that filled it can't be one.
+ */
+static int tok6(PARSER *p, ADDR6 *ap)
+{
+ unsigned char b[16];
+ int i;
+
+ if (p->toklen >= sizeof(p->tok)) return(0);
+ p->tok[p->toklen] = '\0';
+ if (inet_pton(AF_INET6,&p->tok[0],&b[0]) != 1) return(0);
+ for (*ap=0,i=0;i<16;i++) *ap = (*ap << 8) | b[i];
+ return(1);
+}
+
+/*
+ * Start on an IPv6 address found in state ustate, whose beginning is
+ *  in tok[] (if anything).  A pending IPv4 address is saved, just as if
+ *  another IPv4 address had started; one that ends an IPv4 range is an
+ *  error.
+ */
+static void start6(PARSER *p)
+{
+ p->state = 20;
+ switch (p->ustate)
+  { default:
+       abort();
+       break;
+    case 1:
+       p->n = 0;
+       break;
+    case 9:
+       if (p->n >= 0) save_one_addr(p,p->a);
+       break;
+    case 10:
+       if (p->n >= 0) complain(p,"line %d: IPv6 address in an IPv4 range\n",p->line);
+       p->n = -1;
+       return;
+  }
+ if (p->set6 == 0)
+  { if (p->n >= 0) complain(p,"line %d: IPv6 isn't supported here\n",p->line);
+    p->n = -1;
+  }
+}
+
+static void parse_block(PARSER *, const unsigned char *, size_t);
+
+/*
+ * Settle a token stashed in state 26: if it has a colon, it's IPv6,
+ *  and we go on collecting it in state 20; if not, it goes back through
+ *  the IPv4 machine.
+ */
+static void unstash(PARSER *p)
+{
+ if (memchr(&p->tok[0],':',p->toklen))
+  { start6(p);
+    return;
+  }
+ p->state = p->ustate;
+ p->refeed = 1;
+ parse_block(p,(const unsigned char *)&p->tok[0],p->toklen);
+ p->refeed = 0;
+}
+
+/*
+ * Run the IPv6 states over c.  Returns 1 if c was dealt with, or 0 if
+ *  we've gone back to the IPv4 machine, which should take c from here:
+ *  after a complete address, when c begins something else, or when a
+ *  stashed token turns out not to be IPv6.
+ */
+static int parse6(PARSER *p, int c)
+{
+ ADDR6 a;
+
+ if (p->state == 26)
+  { if (TOK_CHAR6(c) && (p->toklen < sizeof(p->tok)))
+     { p->tok[p->toklen++] = c;
+       return(1);
+     }
+    unstash(p);
+    if (p->state != 20) return(0);
+  }
+ if (TOK_WS(c))
+  { if (c == '\n') p->line ++;
+    switch (p->state)
+     { default:
+          abort();
+          break;
+       case 20:
+          if ((p->n >= 0) && !tok6(p,&p->a6))
+           { complain(p,"line %d: invalid IPv6 address\n",p->line);
+             p->n = -1;
+           }
+          p->state = (p->n >= 0) ? 21 : 1;
+          break;
+       case 21:
+       case 22:
+       case 24:
+          break;
+       case 23:
+          if (p->n >= 0)
+           { if (tok6(p,&a)) save_range6(p,p->s6,a);
+             else complain(p,"line %d: invalid IPv6 address\n",p->line);
+           }
+          p->state = 1;
+          break;
+       case 25:
+          if (p->n >= 0) save_cidr6(p,p->a6,p->n);
+          p->state = 1;
+          break;
+     }
+    return(1);
+  }
+ if ((c == '-') || (c == '/'))
+  { switch (p->state)
+     { default:
+          abort();
+          break;
+       case 20:
+          if ((p->n >= 0) && !tok6(p,&p->a6))
+           { complain(p,"line %d: invalid IPv6 address\n",p->line);
+             p->n = -1;
+           }
+       case 21:
+          p->s6 = p->a6;
+          p->state = (c == '-') ? 22 : 24;
+          break;
+       case 22 ... 25:
+          if (p->n >= 0) complain(p,"line %d: %c at an inappropriate place\n",p->line,c);
+          p->n = -1;
+          break;
+     }
+    return(1);
+  }
+ switch (p->state)
+  { default:
+       abort();
+       break;
+    case 21:
+       save_cidr6(p,p->a6,128);
+       p->n = 0;
+       p->state = 1;
+       return(0);
+    case 22:
+       if (! TOK_CHAR6(c)) break;
+       p->toklen = 0;
+       p->state = 23;
+    case 20:
+    case 23:
+       if (! TOK_CHAR6(c)) break;
+       if (p->toklen < sizeof(p->tok)) p->tok[p->toklen++] = c;
+       return(1);
+    case 24:
+       if (! TOK_DIGIT(c)) break;
+       if (p->n >= 0) p->n = c - '0';
+       p->state = 25;
+       return(1);
+    case 25:
+       if (! TOK_DIGIT(c)) break;
+       if (p->n < 0) return(1);
+       p->n = (p->n * 10) + (c - '0');
+       if (p->n > 128)
+        { complain(p,"line %d: out-of-range width in input\n",p->line);
+          p->n = -1;
+        }
+       return(1);
+  }
+ complain(p,"invalid character 0x%02x in input\n",c);
+ p->n = -1;
+ return(1);
+}
+
+#define PARSE_LOAD(p) (a1 = (p)->a1, a = (p)->a, line = (p)->line, n = (p)->n, state = (p)->state)
+#define PARSE_SAVE(p) ((p)->a1 = a1, (p)->a = a, (p)->line = line, (p)->n = n, (p)->state = state)
+
+static void parse_block(PARSER *p, const unsigned char *buf, size_t len)
+{
+ const unsigned char *end;
+ unsigned long int a1;
+ unsigned long int a;
+ int line;
+ int n;
+ int c;
+ int state;
+ int k6;
+#ifdef FAST_QUAD
+ unsigned long int qa;
+ int w;
+ int k;
+#endif
+
+ PARSE_LOAD(p);
+ for (end=buf+len;buf<end;buf++)
+  { c = *buf;
+    if (state >= 20)
+     { PARSE_SAVE(p);
+       k6 = parse6(p,c);
+       PARSE_LOAD(p);
+       if (k6) continue;
+     }
+#ifdef FAST_QUAD
+    if (quad_ok && ((state == 1) || ((state == 9) && (n >= 0))) &&
+        QUAD_DIGIT(c) && (end-buf >= 16) && ((k = fast_quad(buf,end,&qa,&w)) > 0))
+     { if (state == 9) save_one_addr(p,a);
+       if (buf[k-1] == '\n') line ++;
+       if (w < 0)
+        { a = qa;
+          n = 0;
+          state = 9;
+        }
+       else
+        { save_cidr(p,qa,w);
+          n = w;
+          state = 1;
+        }
+       buf += k - 1;
+       continue;
+     }
+#endif
+    if (((state == 1) || (state == 9) || (state == 10)) && (TOK_HEX(c) || (c == ':')) && !p->refeed &&
+        ((k6 = v6_scan(buf,end)) != 0) && ((k6 > 0) || (end-buf <= sizeof(p->tok))))
+     { PARSE_SAVE(p);
+       p->ustate = state;
+       if (k6 > 0)
+        { p->toklen = 0;
+          start6(p);
+          parse6(p,c);
+        }
+       else
+        { memcpy(&p->tok[0],buf,end-buf);
+          p->toklen = end - buf;
+          p->state = 26;
+          buf = end - 1;
+        }
+       PARSE_LOAD(p);
+       continue;
+     }
+    switch (c)
+     { case '0': case '1': case '2': case '3': case '4':
        case '5': case '6': case '7': case '8': case '9':
           switch (state)
            { default:
@@ -303,13 +2875,13 @@ static void read_input(void)
                 if (n < 0) break;
                 n = (n * 10) + (c - '0');
                 if (n > 255)
-                 { fprintf(stderr,"%s: line %d: out-of-range number in input\n",__progname,line);
+                 { complain(p,"line %d: out-of-range number in input\n",line);
                    n = -1;
                  }
                 break;
              case 9:
                 if (n >= 0)
-                 { save_one_addr(a);
+                 { save_one_addr(p,a);
                    n = c - '0';
                  }
                 state = 2;
@@ -323,7 +2895,7 @@ static void read_input(void)
                 if (n < 0) break;
                 n = (n * 10) + (c - '0');
                 if (n > 32)
-                 { fprintf(stderr,"%s: line %d: out-of-range width in input\n",__progname,line);
+                 { complain(p,"line %d: out-of-range width in input\n",line);
                    n = -1;
                  }
                 break;
@@ -342,7 +2914,7 @@ static void read_input(void)
              case 12:
              case 14:
              case 16 ... 19:
-                if (n >= 0) fprintf(stderr,"%s: line %d: . at an inappropriate place\n",__progname,line);
+                if (n >= 0) complain(p,"line %d: . at an inappropriate place\n",line);
                 n = -1;
                 break;
              case 2:
@@ -360,8 +2932,8 @@ static void read_input(void)
                 break;
              case 9:
                 if (n >= 0)
-                 { save_one_addr(a);
-                   fprintf(stderr,"%s: line %d: . at an inappropriate place\n",__progname,line);
+                 { save_one_addr(p,a);
+                   complain(p,"line %d: . at an inappropriate place\n",line);
                  }
                 n = -1;
                 break;
@@ -374,7 +2946,7 @@ static void read_input(void)
                 break;
              case 1 ... 7:
              case 10 ... 19:
-                fprintf(stderr,"%s: line %d: - at an inappropriate place\n",__progname,line);
+                complain(p,"line %d: - at an inappropriate place\n",line);
                 n = -1;
                 break;
              case 8:
@@ -394,7 +2966,7 @@ static void read_input(void)
                 break;
              case 1 ... 7:
              case 10 ... 19:
-                fprintf(stderr,"%s: line %d: / at an inappropriate place\n",__progname,line);
+                complain(p,"line %d: / at an inappropriate place\n",line);
                 n = -1;
                 break;
              case 8:
@@ -406,85 +2978,2459 @@ static void read_input(void)
                 break;
            }
           break;
-       case '\n':
-          line ++;
-       case ' ': case '\t': case '\r':
-          switch (state)
-           { default:
-                abort();
-                break;
-             case 1:
-             case 9 ... 10:
-             case 18:
-                break;
-             case 2 ... 7:
-             case 11 ... 16:
-                if (n >= 0) fprintf(stderr,"%s: line %d: whitespace at an inappropriate place\n",__progname,line);
-                state = 1;
-                break;
-             case 8:
-                if (n >= 0) a = (a << 8) | n;
-                state = 9;
-                break;
-             case 17:
-                if (n >= 0) save_range(a1,(a<<8)|n);
-                state = 1;
-                break;
-             case 19:
-                if (n >= 0) save_cidr(a,n);
-                state = 1;
-                break;
+       case '\n':
+          line ++;
+       case ' ': case '\t': case '\r':
+          switch (state)
+           { default:
+                abort();
+                break;
+             case 1:
+             case 9 ... 10:
+             case 18:
+                break;
+             case 2 ... 7:
+             case 11 ... 16:
+                if (n >= 0) complain(p,"line %d: whitespace at an inappropriate place\n",line);
+                state = 1;
+                break;
+             case 8:
+                if (n >= 0) a = (a << 8) | n;
+                state = 9;
+                break;
+             case 17:
+                if (n >= 0) save_range(p,a1,(a<<8)|n);
+                state = 1;
+                break;
+             case 19:
+                if (n >= 0) save_cidr(p,a,n);
+                state = 1;
+                break;
+           }
+          break;
+       default:
+          complain(p,"invalid character 0x%02x in input\n",c);
+          n = -1;
+          state = 2;
+          break;
+     }
+  }
+ PARSE_SAVE(p);
+}
+
+/*
+ * Binary input, for --in-format=bin32 or binrange.  Records are four
+ *  bytes, an address, or eight, the start and end of a range, each in
+ *  the byte order given by --byte-order (by default, the machine's
+ *  own).  There's no syntax to go wrong, so the only complaints are
+ *  about reversed ranges and a partial record at EOF.  A record may be
+ *  split across blocks, so any partial record at the end of one is
+ *  kept in the PARSER's rec[] until the next brings the rest.
+ */
+static uint32_t get32(const unsigned char *b)
+{
+ if (little_endian) return(b[0]|(b[1]<<8)|(b[2]<<16)|((uint32_t)b[3]<<24));
+ return(((uint32_t)b[0]<<24)|(b[1]<<16)|(b[2]<<8)|b[3]);
+}
+
+static void parse_record(PARSER *p, const unsigned char *b)
+{
+ if (p->format == FMT_BIN32) save_one_addr(p,get32(b));
+ else save_range(p,get32(b),get32(b+4));
+}
+
+static void parse_bin(PARSER *p, const unsigned char *buf, size_t len)
+{
+ size_t size;
+ size_t n;
+
+ size = (p->format == FMT_BIN32) ? 4 : 8;
+ if (p->rlen > 0)
+  { n = size - p->rlen;
+    if (n > len) n = len;
+    memcpy(&p->rec[p->rlen],buf,n);
+    p->rlen += n;
+    buf += n;
+    len -= n;
+    if (p->rlen < size) return;
+    parse_record(p,&p->rec[0]);
+    p->rlen = 0;
+  }
+ for (;len>=size;buf+=size,len-=size) parse_record(p,buf);
+ memcpy(&p->rec[0],buf,len);
+ p->rlen = len;
+}
+
+static void parse_input(PARSER *p, const unsigned char *buf, size_t len)
+{
+ STAT(p->last = len ? buf[len-1] : p->last);
+ if (p->format == FMT_TEXT) parse_block(p,buf,len);
+ else parse_bin(p,buf,len);
+}
+
+static void parse_end(PARSER *p)
+{
+ if (p->format != FMT_TEXT)
+  { if (p->rlen > 0) complain(p,"EOF in the middle of a record\n");
+    return;
+  }
+ if (p->state == 26) unstash(p);
+ if (p->state >= 20) parse6(p,' ');
+ switch (p->state)
+  { default:
+       abort();
+       break;
+    case 1:
+       break;
+    case 2 ... 7:
+    case 10 ... 16:
+    case 18:
+    case 22:
+    case 24:
+       if (p->n >= 0) complain(p,"line %d: EOF at an inappropriate place\n",p->line);
+       break;
+    case 21:
+       save_cidr6(p,p->a6,128);
+       break;
+    case 8:
+       if (p->n >= 0) save_one_addr(p,(p->a<<8)|p->n);
+       break;
+    case 9:
+       if (p->n >= 0) save_one_addr(p,p->a);
+       break;
+    case 17:
+       if (p->n >= 0) save_range(p,p->a1,(p->a<<8)|p->n);
+       break;
+    case 19:
+       if (p->n >= 0) save_cidr(p,p->a,p->n);
+       break;
+  }
+}
+
+/*
+ * Lookups, for --lookup.  Testing an address against a tree means a
+ *  descent of up to 32 dependent loads scattered over the pool, which
+ *  is far too slow for testing addresses by the billion; even a binary
+ *  search of the set's intervals is twenty-odd, for a large set.  So
+ *  lookup_build flattens the minimal set (from whichever engine built
+ *  it, by walking it) into a two-level table in the style of DIR-24-8
+ *  routing tables: tbl[] has one entry for each /24, which is 0 if
+ *  none of it is present, 1 if all of it is, and otherwise 2 plus the
+ *  index of a 256-bit map, in map[], of which of its addresses are.
+ *  That makes any lookup one load, or two for the /24s that are only
+ *  partly present.  tbl[] is big - 64M - but it's calloc'd, so the
+ *  pages that are never written (which, for a small set, is nearly all
+ *  of them) are never made real.
+ *
+ * A range is present if all of each /24 it touches is; that's a loop
+ *  over those /24s, and over the 32-bit words of any map at either
+ *  end, testing each word's share of the range at once, but queries
+ *  are nearly always single addresses.  The loop counts in 64 bits,
+ *  so a range that ends at 255.255.255.255 still ends.
+ */
+typedef struct lookup LOOKUP;
+
+struct lookup {
+  uint32_t *tbl;
+  uint32_t (*map)[8];
+  size_t nmaps;
+  size_t maxmaps;
+  } ;
+
+static void lookup_block(void *arg, unsigned long int v, int w)
+{
+ LOOKUP *l;
+ unsigned long int i;
+ uint32_t e;
+
+ l = arg;
+ if (w <= 24)
+  { for (i=0;i<(1UL<<(24-w));i++) l->tbl[(v>>8)+i] = 1;
+    return;
+  }
+ e = l->tbl[v>>8];
+ if (e == 0)
+  { if (l->nmaps >= l->maxmaps)
+     { l->maxmaps = l->maxmaps ? l->maxmaps * 2 : 1024;
+       l->map = realloc(l->map,l->maxmaps*sizeof(l->map[0]));
+       if (l->map == 0) nomem();
+     }
+    memset(&l->map[l->nmaps][0],0,sizeof(l->map[0]));
+    e = 2 + l->nmaps++;
+    l->tbl[v>>8] = e;
+  }
+ for (i=v&0xff;i<(v&0xff)+(1UL<<(32-w));i++) l->map[e-2][i>>5] |= (uint32_t)1 << (i & 31);
+}
+
+static LOOKUP *lookup_build(ENGINE *e, void *set)
+{
+ LOOKUP *l;
+
+ l = malloc(sizeof(LOOKUP));
+ if (l == 0) nomem();
+ l->tbl = calloc((size_t)1<<24,sizeof(uint32_t));
+ if (l->tbl == 0) nomem();
+ l->map = 0;
+ l->nmaps = 0;
+ l->maxmaps = 0;
+ (*e->walk)(set,&lookup_block,l);
+ return(l);
+}
+
+static void lookup_free(LOOKUP *l)
+{
+ free(l->tbl);
+ free(l->map);
+ free(l);
+}
+
+static int lookup_contains(const LOOKUP *l, uint32_t x)
+{
+ uint32_t e;
+
+ e = l->tbl[x>>8];
+ if (e < 2) return(e);
+ return((l->map[e-2][(x>>5)&7] >> (x&31)) & 1);
+}
+
+static int lookup_contains_range(const LOOKUP *l, uint32_t a1, uint32_t a2)
+{
+ uint64_t x;
+ uint32_t last;
+ uint32_t m;
+ uint32_t e;
+
+ for (x=a1;x<=a2;x=(uint64_t)last+1)
+  { e = l->tbl[x>>8];
+    if (e == 0) return(0);
+    if (e == 1)
+     { last = x | 0xff;
+       continue;
+     }
+    last = x | 31;
+    if (last > a2) last = a2;
+    m = (0xffffffffU >> (31-(last&31))) & (0xffffffffU << (x&31));
+    if ((l->map[e-2][(x>>5)&7] & m) != m) return(0);
+  }
+ return(1);
+}
+
+/*
+ * Queries, for --within and --count (and the daemon's within and count
+ *  commands, and the library's cidr_set_walk_within and cidr_set_count):
+ *  the part of the set inside one block w bits wide at a (which must
+ *  have its host bits clear), or how many addresses that is.
+ *
+ * A tree can answer these by going down to the block: the node there
+ *  (if it gets that far before a NONE or an ALL settles things) holds
+ *  the count, and dump_tree can walk everything under it, so nothing
+ *  outside the block is looked at at all.  A block wider than a slot
+ *  covers whole slots, which are summed or walked (by walk_slots, as
+ *  usual) one by one; there are at most 65536 of those.  Every other
+ *  engine, and a tree that has spilled runs to disk, gets the same
+ *  answer from a walk of the whole set, keeping the blocks that are
+ *  inside the query block, and cutting the one that contains it, if
+ *  there is one, down to size.
+ */
+static uint64_t tree_count(TREE *t, unsigned long int a, int w)
+{
+ NODEREF n;
+ uint64_t c;
+ size_t i;
+ size_t j;
+ int bit;
+
+ tree_flush(t);
+ if (w <= t->fanout)
+  { i = SLOT(t,a);
+    c = 0;
+    for (j=0;j<((size_t)1<<(t->fanout-w));j++)
+     { n = t->roots[i+j];
+       if (n == ALL) c += (uint64_t)1 << (32-t->fanout);
+       else if (n != NONE) c += t->nodes[n].count;
+     }
+    return(c);
+  }
+ n = t->roots[SLOT(t,a)];
+ for (bit=31-t->fanout;(bit>31-w)&&(n!=NONE)&&(n!=ALL);bit--) n = t->nodes[n].sub[(a>>bit)&1];
+ if (n == ALL) return((uint64_t)1 << (32-w));
+ return((n == NONE) ? 0 : t->nodes[n].count);
+}
+
+static void tree_walk_within(TREE *t, unsigned long int a, int w, BLOCKFN fn, void *arg)
+{
+ NODEREF n;
+ int bit;
+
+ tree_flush(t);
+ if (w <= t->fanout)
+  { walk_slots(t,SLOT(t,a),(size_t)1<<(t->fanout-w),t->fanout-w,fn,arg);
+    return;
+  }
+ n = t->roots[SLOT(t,a)];
+ for (bit=31-t->fanout;(bit>31-w)&&(n!=NONE)&&(n!=ALL);bit--) n = t->nodes[n].sub[(a>>bit)&1];
+ if (n == ALL) (*fn)(arg,a,w);
+ else dump_tree(t,n,a,31-w,fn,arg);
+}
+
+typedef struct within WITHIN;
+
+struct within {
+  unsigned long int a;
+  int w;
+  BLOCKFN fn;
+  void *arg;
+  uint64_t count;
+  } ;
+
+static void within_block(void *arg, unsigned long int v, int w)
+{
+ WITHIN *q;
+
+ q = arg;
+ if (w <= q->w)
+  { if (w && ((v ^ q->a) & (0xffffffff << (32-w)))) return;
+    v = q->a;
+    w = q->w;
+  }
+ else if (q->w && ((v ^ q->a) & (0xffffffff << (32-q->w)))) return;
+ if (q->fn) (*q->fn)(q->arg,v,w);
+ else q->count += (uint64_t)1 << (32-w);
+}
+
+static int query_fast(ENGINE *e, void *set)
+{
+ return((e->create == &tree_create) && (((TREE *)set)->nruns == 0));
+}
+
+static uint64_t query_count(ENGINE *e, void *set, unsigned long int a, int w)
+{
+ WITHIN q;
+
+ if (query_fast(e,set)) return(tree_count(set,a,w));
+ q.a = a;
+ q.w = w;
+ q.fn = 0;
+ q.count = 0;
+ (*e->walk)(set,&within_block,&q);
+ return(q.count);
+}
+
+static void query_walk(ENGINE *e, void *set, unsigned long int a, int w, BLOCKFN fn, void *arg)
+{
+ WITHIN q;
+
+ if (query_fast(e,set))
+  { tree_walk_within(set,a,w,fn,arg);
+    return;
+  }
+ q.a = a;
+ q.w = w;
+ q.fn = fn;
+ q.arg = arg;
+ (*e->walk)(set,&within_block,&q);
+}
+
+/*
+ * The library interface, declared in cidr-convert.h, for programs that
+ *  want sets without running us and talking through text.  A cidr_set
+ *  is just an engine and a set of its own, so everything here is a
+ *  thin layer over the engine's entry points; addresses are uint32_ts
+ *  rather than the unsigned long ints used inside, and blocks come
+ *  back through a cidr_block_fn, which the cidr_walk adaptor calls.
+ *  A cidr_lookup is a LOOKUP.  Running out of memory is fatal, here as
+ *  everywhere else.
+ */
+struct cidr_set {
+  ENGINE *e;
+  void *set;
+  } ;
+
+struct cidr_walk {
+  cidr_block_fn fn;
+  void *arg;
+  } ;
+
+static void cidr_walk_block(void *arg, unsigned long int v, int w)
+{
+ struct cidr_walk *cw;
+
+ cw = arg;
+ (*cw->fn)(cw->arg,v,w);
+}
+
+cidr_set *cidr_set_new(const char *name)
+{
+ cidr_set *s;
+ ENGINE *e;
+
+ for (e=&engines[0];e->name;e++)
+  { if (name ? !strcmp(e->name,name) : (e == engine)) break;
+  }
+ if (!e->name || e->streams) return(0);
+ s = malloc(sizeof(cidr_set));
+ if (s == 0) nomem();
+ s->e = e;
+ s->set = (*e->create)();
+ return(s);
+}
+
+void cidr_set_free(cidr_set *s)
+{
+ (*s->e->destroy)(s->set);
+ free(s);
+}
+
+void cidr_set_add_addr(cidr_set *s, uint32_t a)
+{
+ (*s->e->add_block)(s->set,a,32);
+}
+
+int cidr_set_add_range(cidr_set *s, uint32_t a1, uint32_t a2)
+{
+ if (a1 > a2) return(-1);
+ if (s->e->add_range) (*s->e->add_range)(s->set,a1,a2);
+ else split_range(a1,a2,s->e->add_block,s->set);
+ return(0);
+}
+
+int cidr_set_add_cidr(cidr_set *s, uint32_t a, int w)
+{
+ if ((w < 0) || (w > 32)) return(-1);
+ (*s->e->add_block)(s->set,w?a&(0xffffffff<<(32-w)):0,w);
+ return(0);
+}
+
+/*
+ * The batch entry points.  Runs of consecutive addresses, which are
+ *  common in real lists, are added as one range.
+ */
+void cidr_set_add_addrs(cidr_set *s, const uint32_t *a, size_t n)
+{
+ size_t i;
+ size_t j;
+
+ for (i=0;i<n;i=j)
+  { j = i + 1;
+    while ((j < n) && (a[j] == a[j-1]+1) && (a[j] != 0)) j ++;
+    if (j == i+1) (*s->e->add_block)(s->set,a[i],32);
+    else cidr_set_add_range(s,a[i],a[j-1]);
+  }
+}
+
+int cidr_set_add_ranges(cidr_set *s, const uint32_t *a1, const uint32_t *a2, size_t n)
+{
+ size_t i;
+ int rv;
+
+ rv = 0;
+ for (i=0;i<n;i++)
+  { if (cidr_set_add_range(s,a1[i],a2[i]) < 0) rv = -1;
+  }
+ return(rv);
+}
+
+/*
+ * Parse text, exactly as if it were an input file, into s.  It must
+ *  be whole, since a token can't continue into the next call.
+ *  Complaints go to err, if it's not nil, and are counted either way;
+ *  the count is returned.
+ */
+int cidr_set_add_text(cidr_set *s, const char *buf, size_t len, FILE *err)
+{
+ PARSER p;
+
+ parse_init(&p,0,s->set);
+ p.e = s->e;
+ p.err = err;
+ p.format = FMT_TEXT;
+ parse_input(&p,(const unsigned char *)buf,len);
+ parse_end(&p);
+ return(p.errors);
+}
+
+/*
+ * Merge from into to, and free from.  When both use the same engine,
+ *  that's the engine's own merge; otherwise we walk from and add its
+ *  blocks to to.
+ */
+void cidr_set_merge(cidr_set *to, cidr_set *from)
+{
+ if ((to->e == from->e) && to->e->merge)
+  { (*to->e->merge)(to->set,from->set);
+    free(from);
+    return;
+  }
+ (*from->e->walk)(from->set,to->e->add_block,to->set);
+ cidr_set_free(from);
+}
+
+void cidr_set_walk(cidr_set *s, cidr_block_fn fn, void *arg)
+{
+ struct cidr_walk cw;
+
+ cw.fn = fn;
+ cw.arg = arg;
+ (*s->e->walk)(s->set,&cidr_walk_block,&cw);
+}
+
+int cidr_set_walk_within(cidr_set *s, uint32_t a, int w, cidr_block_fn fn, void *arg)
+{
+ struct cidr_walk cw;
+
+ if ((w < 0) || (w > 32)) return(-1);
+ cw.fn = fn;
+ cw.arg = arg;
+ query_walk(s->e,s->set,w?a&(0xffffffff<<(32-w)):0,w,&cidr_walk_block,&cw);
+ return(0);
+}
+
+int64_t cidr_set_count(cidr_set *s, uint32_t a, int w)
+{
+ if ((w < 0) || (w > 32)) return(-1);
+ return(query_count(s->e,s->set,w?a&(0xffffffff<<(32-w)):0,w));
+}
+
+cidr_lookup *cidr_lookup_new(cidr_set *s)
+{
+ return((cidr_lookup *)lookup_build(s->e,s->set));
+}
+
+int cidr_lookup_contains(const cidr_lookup *l, uint32_t a)
+{
+ return(lookup_contains((const LOOKUP *)l,a));
+}
+
+int cidr_lookup_contains_range(const cidr_lookup *l, uint32_t a1, uint32_t a2)
+{
+ return((a1 <= a2) && lookup_contains_range((const LOOKUP *)l,a1,a2));
+}
+
+void cidr_lookup_free(cidr_lookup *l)
+{
+ lookup_free((LOOKUP *)l);
+}
+
+#ifndef NO_MAIN
+
+/*
+ * The --stats report.  The parsers' and trees' counts are gathered
+ *  into stats as each file is finished and when the final set is
+ *  done with; stat_phase marks the end of one phase of the run (and
+ *  the start of the next), recording the wall-clock and CPU time (of
+ *  all threads) that went by in it.  The depth histogram is taken from
+ *  the final tree just before the report: the number of interior nodes
+ *  at each depth, counted as the number of address bits above them, so
+ *  the roots are at depth fanout.  It, like the node counts, is only
+ *  there for the tree engine; the peak isn't gathered here at all (see
+ *  stat_hold).  A parser's line count is the newlines it saw, plus one
+ *  if what it last saw of the text didn't end with one.
+ */
+#ifdef STATS
+
+#define MAX_PHASES 8
+
+typedef struct phase PHASE;
+
+struct phase {
+  const char *name;
+  double wall;
+  double cpu;
+  } ;
+
+static struct {
+  int on;
+  unsigned long int lines;
+  unsigned long long int bytes;
+  unsigned long int saved[3];
+  int have_tree;
+  TSTATS tree;
+  unsigned long int depth[33];
+  int nphases;
+  PHASE phases[MAX_PHASES];
+  double wall;
+  double cpu;
+  } stats;
+
+static double stat_clock(clockid_t c)
+{
+ struct timespec ts;
+
+ clock_gettime(c,&ts);
+ return(ts.tv_sec+(ts.tv_nsec/1e9));
+}
+
+static void stat_phase(const char *name)
+{
+ double w;
+ double c;
+
+ w = stat_clock(CLOCK_MONOTONIC);
+ c = stat_clock(CLOCK_PROCESS_CPUTIME_ID);
+ if (name && (stats.nphases < MAX_PHASES))
+  { stats.phases[stats.nphases].name = name;
+    stats.phases[stats.nphases].wall = w - stats.wall;
+    stats.phases[stats.nphases].cpu = c - stats.cpu;
+    stats.nphases ++;
+  }
+ stats.wall = w;
+ stats.cpu = c;
+}
+
+static void stat_parser(const PARSER *p)
+{
+ int i;
+
+ stats.lines += p->line - 1;
+ if ((p->format == FMT_TEXT) && p->last && (p->last != '\n')) stats.lines ++;
+ for (i=0;i<3;i++) stats.saved[i] += p->saved[i];
+}
+
+static void stat_depth(TREE *t, NODEREF n, int d)
+{
+ if ((n == NONE) || (n == ALL)) return;
+ stats.depth[d] ++;
+ stat_depth(t,t->nodes[n].sub[0],d+1);
+ stat_depth(t,t->nodes[n].sub[1],d+1);
+}
+
+static void stat_set(void *set)
+{
+ TREE *t;
+ size_t i;
+
+ if (! stats.on || (engine->create != &tree_create)) return;
+ t = set;
+ stats.have_tree = 1;
+ tstats_add(&stats.tree,&t->st);
+ for (i=0;i<t->nroots;i++) stat_depth(t,t->roots[i],t->fanout);
+}
+
+static void stat_report(void)
+{
+ int i;
+
+ if (! stats.on) return;
+ fprintf(stderr,"%s: stats: %lu lines, %llu bytes\n",__progname,stats.lines,stats.bytes);
+ fprintf(stderr,"%s: stats: saved %lu addresses, %lu ranges, %lu blocks\n",__progname,stats.saved[0],stats.saved[1],stats.saved[2]);
+ if (stats.have_tree)
+  { fprintf(stderr,"%s: stats: %lu nodes allocated, %lu collapses to ALL, %lu nodes freed by free_tree, %ld peak live\n",
+       __progname,stats.tree.allocs,stats.tree.collapses,stats.tree.frees,stat_peak);
+    for (i=0;i<33;i++)
+     { if (stats.depth[i]) fprintf(stderr,"%s: stats: depth %d: %lu nodes\n",__progname,i,stats.depth[i]);
+     }
+  }
+ for (i=0;i<stats.nphases;i++)
+  { fprintf(stderr,"%s: stats: %s: %.3fs wall, %.3fs cpu\n",__progname,stats.phases[i].name,stats.phases[i].wall,stats.phases[i].cpu);
+  }
+}
+
+#endif
+
+/*
+ * Read input from a file descriptor a block at a time with read(2),
+ *  which is far cheaper per byte than stdio's getchar, and hand each
+ *  block straight to the state machine.  If the engine streams, what
+ *  it has printed so far is flushed before we (perhaps) wait for more.
+ */
+static void read_fd(PARSER *p, int fd)
+{
+ static unsigned char buf[65536];
+ ssize_t r;
+
+ while (1)
+  { if (p->e->streams) out_flush(&out);
+    r = read(fd,&buf[0],sizeof(buf));
+    if (r < 0)
+     { if (errno == EINTR) continue;
+       if (p->name) fprintf(stderr,"%s: %s: read error: %s\n",__progname,p->name,strerror(errno));
+       else fprintf(stderr,"%s: read error: %s\n",__progname,strerror(errno));
+       exit(1);
+     }
+    if (r == 0) break;
+    STAT(stats.bytes += r);
+    parse_input(p,&buf[0],r);
+  }
+}
+
+/*
+ * Parallel parsing, for -j.  A mapped file is cut into one chunk per
+ *  job, and each chunk is parsed by its own thread into a set of its
+ *  own; the sets are then merged pairwise, also in parallel, and the
+ *  result merged into the caller's set.  Since all the engines can
+ *  merge, this works whichever one is in use.
+ *
+ * The trick is making the result exactly what parsing the whole file
+ *  in one piece would have produced, complaints included.  We cut only
+ *  just after a newline that's followed by a digit.  At such a point
+ *  the machine has usually just finished an address (state 9) or is
+ *  between tokens (state 1), and then starting the next chunk afresh
+ *  in state 1 and finishing this one with parse_end does the same as
+ *  carrying straight on would.  Otherwise - say a range was split
+ *  across lines, or we're in the middle of suppressing something after
+ *  an error - the chunk is "dirty".  Complaints are written to a
+ *  per-job buffer rather than to stderr, and after all the jobs are
+ *  done, if any chunk but the last came out dirty, all the jobs'
+ *  results are thrown away and the file is parsed serially; if not,
+ *  the buffers are copied out in order.  So that line numbers are
+ *  right, a first round of jobs counts the newlines in each chunk.
+ *
+ * Chunks smaller than MIN_CHUNK aren't worth a thread, so small files
+ *  don't get as many jobs (perhaps only one) as were asked for.
+ */
+#define MIN_CHUNK 65536
+
+static int jobs = 1;
+
+typedef struct job JOB;
+
+struct job {
+  pthread_t tid;
+  int running;
+  const unsigned char *buf;
+  size_t len;
+  int last;
+  int dirty;
+  PARSER p;
+  char *errbuf;
+  size_t errlen;
+  void *from;
+  } ;
+
+/*
+ * Run fn on every step'th job from 0 up to n, each in a thread of its
+ *  own, and wait for them all.  If we can't get a thread, we run the
+ *  job ourselves.
+ */
+static void run_jobs(JOB *j, int n, int step, void *(*fn)(void *))
+{
+ int i;
+
+ for (i=0;i<n;i+=step)
+  { j[i].running = ! pthread_create(&j[i].tid,0,fn,&j[i]);
+    if (! j[i].running) (*fn)(&j[i]);
+  }
+ for (i=0;i<n;i+=step)
+  { if (j[i].running) pthread_join(j[i].tid,0);
+  }
+}
+
+static void *count_job(void *arg)
+{
+ JOB *j;
+ const unsigned char *s;
+ const unsigned char *end;
+
+ j = arg;
+ j->p.line = 0;
+ end = j->buf + j->len;
+ for (s=j->buf;(s=memchr(s,'\n',end-s));s++) j->p.line ++;
+ return(0);
+}
+
+static void *parse_job(void *arg)
+{
+ JOB *j;
+
+ j = arg;
+ parse_block(&j->p,j->buf,j->len);
+ if (! j->last)
+  { j->dirty = (j->p.state != 1) && (j->p.state != 21) && ((j->p.state != 9) || (j->p.n < 0));
+    if (j->dirty) return(0);
+  }
+ parse_end(&j->p);
+ return(0);
+}
+
+static void *merge_job(void *arg)
+{
+ JOB *j;
+
+ j = arg;
+ (*j->p.e->merge)(j->p.set,j->from);
+ return(0);
+}
+
+static void parse_parallel(PARSER *p, const unsigned char *buf, size_t len)
+{
+ JOB *j;
+ int nj;
+ int i;
+ int line;
+ int dirty;
+ size_t at;
+ size_t start;
+ const unsigned char *s;
+
+ STAT(p->last = len ? buf[len-1] : p->last);
+ nj = p->e->merge ? jobs : 1;
+ if (len/MIN_CHUNK < nj) nj = len / MIN_CHUNK;
+ if (nj < 2)
+  { parse_block(p,buf,len);
+    return;
+  }
+ j = calloc(nj,sizeof(JOB));
+ if (j == 0) nomem();
+ for (start=0,i=0;i<nj-1;i++)
+  { at = (len / nj) * (i + 1);
+    if (at < start) at = start;
+    for (s=buf+at;(s=memchr(s,'\n',buf+len-s));s++)
+     { if ((s+1 < buf+len) && ((unsigned int)(s[1] - '0') < 10)) break;
+     }
+    if (s == 0) break;
+    j[i].buf = buf + start;
+    j[i].len = (s + 1 - buf) - start;
+    start = s + 1 - buf;
+  }
+ j[i].buf = buf + start;
+ j[i].len = len - start;
+ j[i].last = 1;
+ nj = i + 1;
+ run_jobs(j,nj,1,&count_job);
+ for (line=p->line,i=0;i<nj;i++)
+  { at = j[i].p.line;
+    parse_init(&j[i].p,p->name,(*p->e->create)());
+    j[i].p.e = p->e;
+    if (p->set6) j[i].p.set6 = trie_create6();
+    j[i].p.line = line;
+    j[i].p.err = open_memstream(&j[i].errbuf,&j[i].errlen);
+    if (j[i].p.err == 0) nomem();
+    line += at;
+  }
+ run_jobs(j,nj,1,&parse_job);
+ for (dirty=0,i=0;i<nj;i++)
+  { fclose(j[i].p.err);
+    if (j[i].dirty) dirty = 1;
+  }
+ if (dirty)
+  { for (i=0;i<nj;i++)
+     { (*p->e->destroy)(j[i].p.set);
+       if (j[i].p.set6) trie_destroy6(j[i].p.set6);
+       free(j[i].errbuf);
+     }
+    free(j);
+    parse_block(p,buf,len);
+    return;
+  }
+ for (i=0;i<nj;i++)
+  { fwrite(j[i].errbuf,1,j[i].errlen,p->err);
+    free(j[i].errbuf);
+    if (j[i].p.set6) trie_merge6(p->set6,j[i].p.set6);
+    STAT(p->saved[0] += j[i].p.saved[0]);
+    STAT(p->saved[1] += j[i].p.saved[1]);
+    STAT(p->saved[2] += j[i].p.saved[2]);
+  }
+ for (at=1;at<nj;at*=2)
+  { for (i=0;i+at<nj;i+=2*at) j[i].from = j[i+at].p.set;
+    run_jobs(j,nj-at,2*at,&merge_job);
+  }
+ (*p->e->merge)(p->set,j[0].p.set);
+ p->line = j[nj-1].p.line;
+ p->state = 1;
+ free(j);
+}
+
+/*
+ * Read one input file (- means stdin).  Each file is parsed on its
+ *  own, as if it were the whole input.  A regular file is mapped and
+ *  the state machine run over the mapping directly, which saves
+ *  copying everything through a buffer; anything we can't map (a
+ *  pipe, or an empty file) is read the ordinary way.
+ */
+static void read_file(const char *name, void *set, void *set6)
+{
+ PARSER p;
+ struct stat stb;
+ void *m;
+ int fd;
+
+ if (! strcmp(name,"-"))
+  { parse_init(&p,0,set);
+    p.set6 = set6;
+    read_fd(&p,0);
+    parse_end(&p);
+    STAT(stat_parser(&p));
+    return;
+  }
+ fd = open(name,O_RDONLY,0);
+ if (fd < 0)
+  { fprintf(stderr,"%s: %s: %s\n",__progname,name,strerror(errno));
+    exit(1);
+  }
+ parse_init(&p,name,set);
+ p.set6 = set6;
+ m = MAP_FAILED;
+ if ((fstat(fd,&stb) == 0) && S_ISREG(stb.st_mode) && (stb.st_size > 0) && ((size_t)stb.st_size == stb.st_size))
+  { m = mmap(0,stb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  }
+ if (m != MAP_FAILED)
+  { madvise(m,stb.st_size,MADV_SEQUENTIAL);
+    STAT(stats.bytes += stb.st_size);
+    if ((jobs > 1) && (p.format == FMT_TEXT)) parse_parallel(&p,m,stb.st_size);
+    else parse_input(&p,m,stb.st_size);
+    munmap(m,stb.st_size);
+  }
+ else
+  { read_fd(&p,fd);
+  }
+ close(fd);
+ parse_end(&p);
+ STAT(stat_parser(&p));
+}
+
+/*
+ * Read-ahead, for --readers.  When the input is a dozen files on slow
+ *  (network, say) storage, reading them one after another, and only
+ *  as fast as we parse, leaves us idle whenever a read has to wait.
+ *  So here a pool of reader threads reads all the inputs at once,
+ *  each thread taking the next file in order that nobody has taken
+ *  yet and reading it to the end, while we parse the files, still in
+ *  order and still each on its own, from what they've read.  The
+ *  parsing then only waits for I/O if it's got ahead of every reader.
+ *
+ * Each file has its own ring of READ_DEPTH buffers between its reader
+ *  and us.  The ring has a single producer and a single consumer, each
+ *  with its own end of it, so it needs no lock; two semaphores count
+ *  the full and empty slots, and are only slept on when the ring is
+ *  empty or full.  That bounds what's read ahead to READ_DEPTH buffers
+ *  a file.  Each buffer is filled (from a pipe, say, that can take
+ *  several reads) unless the engine streams, when whatever one read
+ *  brings is passed on at once.  A slot with len 0 is EOF, and one
+ *  with len -1 is an error (err being the errno, and where saying
+ *  whether it was the open), which we report only when we get to it,
+ *  so complaints come out in the same order as ever, and so does
+ *  everything else: since files are taken in order, the one we're
+ *  waiting for always has a reader on it.  What -j does for a mapped
+ *  file is not done here; the files are parsed serially as they
+ *  arrive.
+ */
+#define READ_BUF 262144
+#define READ_DEPTH 4
+#define MAX_READERS 64
+
+static int readers = 0;
+
+typedef struct source SOURCE;
+
+struct source {
+  const char *name;
+  sem_t full;
+  sem_t empty;
+  unsigned char *buf[READ_DEPTH];
+  ssize_t len[READ_DEPTH];
+  int err;
+  int where;
+  } ;
+
+typedef struct rpool RPOOL;
+
+struct rpool {
+  SOURCE *s;
+  int n;
+  int next;
+  } ;
+
+static void sem_sleep(sem_t *s)
+{
+ while (sem_wait(s) < 0)
+  { if (errno != EINTR) abort();
+  }
+}
+
+static void *reader_job(void *arg)
+{
+ RPOOL *r;
+ SOURCE *s;
+ ssize_t got;
+ ssize_t n;
+ int fd;
+ int i;
+ int k;
+
+ r = arg;
+ while ((k = __atomic_fetch_add(&r->next,1,__ATOMIC_RELAXED)) < r->n)
+  { s = &r->s[k];
+    fd = strcmp(s->name,"-") ? open(s->name,O_RDONLY,0) : 0;
+    if (fd < 0)
+     { s->err = errno;
+       s->where = 1;
+     }
+    n = 1;
+    for (i=0;;i=(i+1)%READ_DEPTH)
+     { sem_sleep(&s->empty);
+       if ((fd < 0) || (n <= 0))
+        { s->len[i] = (fd < 0) ? -1 : n;
+          sem_post(&s->full);
+          break;
+        }
+       if (s->buf[i] == 0) s->buf[i] = malloc(READ_BUF);
+       if (s->buf[i] == 0) nomem();
+       for (got=0;got<READ_BUF;)
+        { n = read(fd,s->buf[i]+got,READ_BUF-got);
+          if ((n < 0) && (errno == EINTR)) continue;
+          if (n < 0)
+           { s->err = errno;
+             s->where = 0;
            }
-          break;
-       default:
-          fprintf(stderr,"%s: invalid character 0x%02x in input\n",__progname,c);
-          n = -1;
-          state = 2;
-          break;
+          if (n <= 0) break;
+          got += n;
+          if (engine->streams) break;
+        }
+       s->len[i] = got ? got : n;
+       sem_post(&s->full);
+       if (got == 0) break;
+     }
+    if (fd > 0) close(fd);
+  }
+ return(0);
+}
+
+static char *stdin_only[] = { "-" };
+
+/*
+ * Read files[0..n-1] with the readers, each into sets[i] if sets isn't
+ *  nil, and into set if it is (and its IPv6 into set6).  If we can't
+ *  get a single thread, the files are read the ordinary way.
+ */
+static void read_ahead(char **files, int n, void *set, void **sets, void *set6)
+{
+ RPOOL r;
+ PARSER p;
+ SOURCE *s;
+ pthread_t *tid;
+ int *running;
+ int nt;
+ int ok;
+ int i;
+ int k;
+
+ r.s = calloc(n,sizeof(SOURCE));
+ nt = (readers < n) ? readers : n;
+ tid = malloc(nt*sizeof(pthread_t));
+ running = malloc(nt*sizeof(int));
+ if ((r.s == 0) || (tid == 0) || (running == 0)) nomem();
+ r.n = n;
+ r.next = 0;
+ for (k=0;k<n;k++)
+  { r.s[k].name = files[k];
+    if ((sem_init(&r.s[k].full,0,0) < 0) || (sem_init(&r.s[k].empty,0,READ_DEPTH) < 0))
+     { fprintf(stderr,"%s: sem_init: %s\n",__progname,strerror(errno));
+       exit(1);
+     }
+  }
+ for (ok=0,i=0;i<nt;i++)
+  { running[i] = ! pthread_create(&tid[i],0,&reader_job,&r);
+    if (running[i]) ok = 1;
+  }
+ for (k=0;k<n;k++)
+  { if (! ok)
+     { read_file(files[k],sets?sets[k]:set,set6);
+       continue;
+     }
+    s = &r.s[k];
+    parse_init(&p,strcmp(s->name,"-")?s->name:0,sets?sets[k]:set);
+    p.set6 = set6;
+    for (i=0;;i=(i+1)%READ_DEPTH)
+     { if (sem_trywait(&s->full) < 0)
+        { if (p.e->streams) out_flush(&out);
+          sem_sleep(&s->full);
+        }
+       if (s->len[i] < 0)
+        { if (s->where) fprintf(stderr,"%s: %s: %s\n",__progname,s->name,strerror(s->err));
+          else if (p.name) fprintf(stderr,"%s: %s: read error: %s\n",__progname,p.name,strerror(s->err));
+          else fprintf(stderr,"%s: read error: %s\n",__progname,strerror(s->err));
+          exit(1);
+        }
+       if (s->len[i] == 0) break;
+       STAT(stats.bytes += s->len[i]);
+       parse_input(&p,s->buf[i],s->len[i]);
+       sem_post(&s->empty);
+     }
+    parse_end(&p);
+    STAT(stat_parser(&p));
+    for (i=0;i<READ_DEPTH;i++) free(s->buf[i]);
+  }
+ for (i=0;i<nt;i++)
+  { if (running[i]) pthread_join(tid[i],0);
+  }
+ for (k=0;k<n;k++)
+  { sem_destroy(&r.s[k].full);
+    sem_destroy(&r.s[k].empty);
+  }
+ free(running);
+ free(tid);
+ free(r.s);
+}
+
+/*
+ * Read input: the files named on the command line, in order, or stdin
+ *  if there aren't any, into set, and any IPv6 input into set6 (if
+ *  it's nil, IPv6 input is complained about instead).
+ */
+static void read_input(char **files, int nfiles, void *set, void *set6)
+{
+ int i;
+
+ if (readers) read_ahead(nfiles?files:stdin_only,nfiles?nfiles:1,set,0,set6);
+ else if (nfiles == 0) read_file("-",set,set6);
+ else for (i=0;i<nfiles;i++) read_file(files[i],set,set6);
+}
+
+/*
+ * Read input for --combine: each file (or stdin, if there aren't any)
+ *  into a set of its own, and then those sets combined with op into
+ *  the one returned.
+ */
+static void *combine_input(char **files, int nfiles, int op)
+{
+ void **sets;
+ void *set;
+ int n;
+ int i;
+
+ n = nfiles ? nfiles : 1;
+ sets = malloc(n*sizeof(void *));
+ if (sets == 0) nomem();
+ for (i=0;i<n;i++)
+  { sets[i] = (*engine->create)();
+    if (! readers) read_file(nfiles?files[i]:"-",sets[i],0);
+  }
+ if (readers) read_ahead(nfiles?files:stdin_only,n,0,sets,0);
+ set = (*engine->combine)(sets,n,op);
+ free(sets);
+ return(set);
+}
+
+/*
+ * Saved state, for --save-state and --load-state.  A tree is already
+ *  just an array of nodes that refer to each other by index, plus the
+ *  roots, so that's what's saved - the file is a header, the nodes,
+ *  and the roots, in the machine's own byte order (version 1 had no
+ *  counts in the nodes, so it's not read) - and loading one is a
+ *  matter of mapping it and pointing the pool at the nodes, in place:
+ *  nothing is parsed, or even read, beyond checking it.  The mapping
+ *  is private, so changing a node that came from the file gets that
+ *  page a copy of its own rather than changing the file.  The file is
+ *  mapped at the start of a bigger anonymous mapping, with room after
+ *  it for about as many nodes again, and the pool takes nodes from
+ *  that room (the saved roots, which are copied out at once, are the
+ *  first of it) without copying anything; only once that's full does
+ *  the whole array have to be copied out (see pool_get), as it would
+ *  have been had it all been malloc'd from the start.
+ *
+ * Saving writes only the nodes that are in use, renumbered in
+ *  post-order from FIRST_NODE (slots 0 and 1 are written too, as
+ *  zeros, so the numbers still index the array), so every node's
+ *  children come before it.  Loading checks that, since it means
+ *  there can be no cycles and no index out of range, and it checks
+ *  the header, the version, and a checksum of each part (FNV-1a, over
+ *  32-bit words) so that a damaged or foreign file is refused rather
+ *  than believed.  The state is written to a temporary file beside
+ *  the one named and renamed into place, so the same file can be
+ *  loaded and saved by one run, and is never seen half-written.
+ */
+#define STATE_MAGIC "cidrtree"
+#define STATE_VERSION 2
+#define STATE_ORDER 0x01020304
+#define STATE_SUM0 0xcbf29ce484222325ULL
+#define NODE_WORDS (sizeof(NODE)/sizeof(uint32_t))
+
+typedef struct state_head STATE_HEAD;
+
+struct state_head {
+  char magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint32_t fanout;
+  uint32_t nnodes;
+  uint64_t nodes_sum;
+  uint64_t roots_sum;
+  uint64_t head_sum;
+  } ;
+
+typedef struct state_out STATE_OUT;
+
+struct state_out {
+  FILE *f;
+  const char *name;
+  NODEREF next;
+  uint64_t sum;
+  } ;
+
+static uint64_t state_sum(uint64_t h, const uint32_t *v, size_t n)
+{
+ size_t i;
+
+ for (i=0;i<n;i++) h = (h ^ v[i]) * 0x100000001b3ULL;
+ return(h);
+}
+
+static void state_write(STATE_OUT *o, const uint32_t *v, size_t n)
+{
+ if (fwrite(v,sizeof(uint32_t),n,o->f) != n)
+  { fprintf(stderr,"%s: %s: write error: %s\n",__progname,o->name,strerror(errno));
+    exit(1);
+  }
+ o->sum = state_sum(o->sum,v,n);
+}
+
+static NODEREF state_save_node(TREE *t, NODEREF n, STATE_OUT *o)
+{
+ NODE nd;
+
+ if ((n == NONE) || (n == ALL)) return(n);
+ nd.sub[0] = state_save_node(t,t->nodes[n].sub[0],o);
+ nd.sub[1] = state_save_node(t,t->nodes[n].sub[1],o);
+ nd.count = t->nodes[n].count;
+ state_write(o,(uint32_t *)&nd,NODE_WORDS);
+ if (o->next == 0xffffffff) nomem();
+ return(o->next++);
+}
+
+static void save_state(const char *name, void *set)
+{
+ TREE *t;
+ STATE_OUT o;
+ STATE_HEAD h;
+ NODEREF *roots;
+ uint32_t zero[FIRST_NODE*NODE_WORDS];
+ char *tmp;
+ size_t i;
+ mode_t mask;
+ int fd;
+
+ t = set;
+ tree_flush(t);
+ tmp = malloc(strlen(name)+sizeof(".XXXXXX"));
+ if (tmp == 0) nomem();
+ sprintf(tmp,"%s.XXXXXX",name);
+ fd = mkstemp(tmp);
+ if (fd >= 0)
+  { mask = umask(0);
+    umask(mask);
+    fchmod(fd,0666&~mask);
+  }
+ o.f = (fd < 0) ? 0 : fdopen(fd,"w");
+ if (o.f == 0)
+  { fprintf(stderr,"%s: %s: %s\n",__progname,tmp,strerror(errno));
+    exit(1);
+  }
+ o.name = tmp;
+ memset(&h,0,sizeof(h));
+ memset(&zero[0],0,sizeof(zero));
+ o.sum = STATE_SUM0;
+ state_write(&o,(uint32_t *)&h,sizeof(h)/sizeof(uint32_t));
+ o.sum = STATE_SUM0;
+ state_write(&o,&zero[0],FIRST_NODE*NODE_WORDS);
+ o.next = FIRST_NODE;
+ roots = malloc(t->nroots*sizeof(NODEREF));
+ if (roots == 0) nomem();
+ for (i=0;i<t->nroots;i++) roots[i] = state_save_node(t,t->roots[i],&o);
+ h.nodes_sum = o.sum;
+ h.nnodes = o.next;
+ o.sum = STATE_SUM0;
+ state_write(&o,roots,t->nroots);
+ h.roots_sum = o.sum;
+ free(roots);
+ memcpy(&h.magic[0],STATE_MAGIC,8);
+ h.version = STATE_VERSION;
+ h.order = STATE_ORDER;
+ h.fanout = t->fanout;
+ h.head_sum = state_sum(STATE_SUM0,(uint32_t *)&h,offsetof(STATE_HEAD,head_sum)/sizeof(uint32_t));
+ if (fseek(o.f,0,SEEK_SET) < 0)
+  { fprintf(stderr,"%s: %s: %s\n",__progname,tmp,strerror(errno));
+    exit(1);
+  }
+ state_write(&o,(uint32_t *)&h,sizeof(h)/sizeof(uint32_t));
+ if (fclose(o.f) != 0)
+  { fprintf(stderr,"%s: %s: write error: %s\n",__progname,tmp,strerror(errno));
+    exit(1);
+  }
+ if (rename(tmp,name) < 0)
+  { fprintf(stderr,"%s: %s: %s\n",__progname,name,strerror(errno));
+    unlink(tmp);
+    exit(1);
+  }
+ free(tmp);
+}
+
+static void state_bad(const char *name, const char *why)
+{
+ fprintf(stderr,"%s: %s: %s\n",__progname,name,why);
+ exit(1);
+}
+
+/*
+ * Load a saved state as a new tree.  The tree's fanout is the one it
+ *  was saved with; so that everything else built in this run can be
+ *  merged with it, that becomes the fanout for every tree from now on.
+ */
+static void *load_state(const char *name)
+{
+ TREE *t;
+ STATE_HEAD *h;
+ NODE *nodes;
+ NODEREF *roots;
+ struct stat stb;
+ char *m;
+ size_t nroots;
+ size_t len;
+ size_t room;
+ size_t cap;
+ NODEREF n;
+ int fd;
+
+ fd = open(name,O_RDONLY,0);
+ if ((fd < 0) || (fstat(fd,&stb) < 0))
+  { fprintf(stderr,"%s: %s: %s\n",__progname,name,strerror(errno));
+    exit(1);
+  }
+ if ((stb.st_size < sizeof(STATE_HEAD)) || ((size_t)stb.st_size != stb.st_size)) state_bad(name,"not a saved state");
+ len = stb.st_size;
+ room = (len < SIZE_MAX/4) ? len + (65536*sizeof(NODE)) : 0;
+ m = mmap(0,len+room,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+ if ((m == MAP_FAILED) || (mmap(m,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,fd,0) == MAP_FAILED))
+  { fprintf(stderr,"%s: %s: %s\n",__progname,name,strerror(errno));
+    exit(1);
+  }
+ close(fd);
+ h = (STATE_HEAD *) m;
+ if (memcmp(&h->magic[0],STATE_MAGIC,8)) state_bad(name,"not a saved state");
+ if ((h->version != STATE_VERSION) || (h->order != STATE_ORDER)) state_bad(name,"saved state in a format (or byte order) this version can't read");
+ if (h->head_sum != state_sum(STATE_SUM0,(uint32_t *)h,offsetof(STATE_HEAD,head_sum)/sizeof(uint32_t))) state_bad(name,"saved state is corrupt");
+ if ((h->fanout % 8) || (h->fanout > 16) || (h->nnodes < FIRST_NODE)) state_bad(name,"saved state is corrupt");
+ nroots = (size_t)1 << h->fanout;
+ if (stb.st_size != sizeof(STATE_HEAD)+((size_t)h->nnodes*sizeof(NODE))+(nroots*sizeof(NODEREF))) state_bad(name,"saved state is corrupt");
+ nodes = (NODE *) (m + sizeof(STATE_HEAD));
+ roots = (NODEREF *) (nodes + h->nnodes);
+ if ((h->nodes_sum != state_sum(STATE_SUM0,(uint32_t *)nodes,(size_t)h->nnodes*NODE_WORDS)) ||
+     (h->roots_sum != state_sum(STATE_SUM0,roots,nroots))) state_bad(name,"saved state is corrupt");
+ for (n=FIRST_NODE;n<h->nnodes;n++)
+  { if ((nodes[n].sub[0] >= n) || (nodes[n].sub[1] >= n)) state_bad(name,"saved state is corrupt");
+  }
+ for (n=0;n<nroots;n++)
+  { if (roots[n] >= h->nnodes) state_bad(name,"saved state is corrupt");
+  }
+ fanout = h->fanout;
+ t = tree_create();
+ t->sorted = 0;
+ memcpy(t->roots,roots,nroots*sizeof(NODEREF));
+ cap = (len + room - sizeof(STATE_HEAD)) / sizeof(NODE);
+ t->pool.mem = (char *) nodes;
+ t->pool.used = h->nnodes;
+ t->pool.alloc = (cap < 0xffffffff) ? cap : 0xffffffff;
+ t->pool.map = m;
+ t->pool.maplen = len + room;
+ t->nodes = nodes;
+ STAT(stat_hold(t));
+ return(t);
+}
+
+/*
+ * The queries are read by the ordinary parser, so they can be anything
+ *  the input can be, and complained about in the same way; to make
+ *  that work, the parser is pointed at an engine whose "set" is the
+ *  LOOKUP, and whose add_block and add_range print each query that is
+ *  wholly present - an address as itself, a block as a block, and a
+ *  range as a range - and ignore the rest.
+ */
+static void put_range(OUTBUF *o, unsigned long int a1, unsigned long int a2)
+{
+ char *p;
+
+ if (o->len > sizeof(o->buf)-(2*MAX_LINE)) out_flush(o);
+ p = put_quad(&o->buf[o->len],a1);
+ if (a2 != a1)
+  { *p++ = '-';
+    p = put_quad(p,a2);
+  }
+ *p++ = '\n';
+ o->len = p - &o->buf[0];
+}
+
+static void query_range(void *set, unsigned long int a1, unsigned long int a2)
+{
+ if (lookup_contains_range(set,a1,a2)) put_range(&out,a1,a2);
+}
+
+static void query_block(void *set, unsigned long int a, int w)
+{
+ if (w == 32)
+  { if (lookup_contains(set,a)) put_range(&out,a,a);
+  }
+ else if (lookup_contains_range(set,a,a|(0xffffffff>>w))) put_block(&out,a,w);
+}
+
+static ENGINE query_engine = { "lookup", 0, &query_block, &query_range };
+
+/*
+ * Parallel output, for -j.  With tens of millions of blocks, walking
+ *  the tree and formatting them is a long serial tail after parsing in
+ *  parallel, but the tree comes apart naturally: the blocks under one
+ *  node don't depend on anything outside it.  So we cut the tree at
+ *  depth OUT_SPLIT_BITS (or the fanout, if that's deeper) into pieces
+ *  each of which walk_slots or dump_tree can walk by itself - a group
+ *  of slots, a node, or an ALL that's a block on its own - in address
+ *  order, just as walk_slots would come to them, and with the same
+ *  collapsing of full groups.  The pieces are handed out in that order
+ *  to a set of worker threads, started once for the whole dump, each
+ *  of which formats a piece into an OUTBUF of its own that collects in
+ *  memory.  We, meanwhile, write the buffers out, in order, with
+ *  writev, a wave of OUT_WAVE pieces per worker at a time.  Workers
+ *  may only take pieces below limit, which is the end of the wave
+ *  after the one being written: as soon as one wave is all done, limit
+ *  moves on to let them start on the next but one, and while we write,
+ *  they format.  So the output is exactly the serial walk's, no more
+ *  than two waves of it are in memory at once, and the writing isn't
+ *  a serial tail after the formatting but goes on alongside it.  If we
+ *  can't get any threads at all, we format each wave ourselves before
+ *  writing it.
+ *
+ * Trees too small to be worth it (fewer than OUT_MIN_NODES nodes), or
+ *  with some of their contents on disk, go the ordinary way.
+ */
+#define OUT_SPLIT_BITS 12
+#define OUT_WAVE 8
+#define OUT_MIN_NODES 1048576
+
+#ifdef IOV_MAX
+#define OUT_IOV IOV_MAX
+#else
+#define OUT_IOV 16
+#endif
+
+typedef struct opiece OPIECE;
+
+struct opiece {
+  NODEREF n;
+  unsigned long int v;
+  int bit;
+  size_t slot;
+  size_t nslots;
+  int k;
+  char *mem;
+  size_t len;
+  int done;
+  } ;
+
+typedef struct oplan OPLAN;
+
+struct oplan {
+  TREE *t;
+  BLOCKFN fn;
+  OPIECE *p;
+  size_t n;
+  size_t max;
+  size_t next;
+  size_t limit;
+  int split;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  pthread_cond_t done;
+  } ;
+
+static OPIECE *plan_piece(OPLAN *pl)
+{
+ if (pl->n >= pl->max)
+  { pl->max = pl->max ? pl->max * 2 : 1024;
+    pl->p = realloc(pl->p,pl->max*sizeof(OPIECE));
+    if (pl->p == 0) nomem();
+  }
+ memset(&pl->p[pl->n],0,sizeof(OPIECE));
+ return(&pl->p[pl->n++]);
+}
+
+static void plan_node(OPLAN *pl, NODEREF n, unsigned long int v, int bit)
+{
+ OPIECE *p;
+
+ if (n == NONE) return;
+ if ((n == ALL) || (bit <= 31-pl->split))
+  { p = plan_piece(pl);
+    p->n = n;
+    p->v = v;
+    p->bit = bit;
+    return;
+  }
+ plan_node(pl,pl->t->nodes[n].sub[0],v,bit-1);
+ plan_node(pl,pl->t->nodes[n].sub[1],v|(1UL<<bit),bit-1);
+}
+
+/*
+ * The same cuts walk_slots makes, down to groups of slots no bigger
+ *  than the split depth calls for, and then on into single slots'
+ *  subtrees if it's deeper than the fanout.
+ */
+static void plan_slots(OPLAN *pl, size_t i, size_t n, int k)
+{
+ TREE *t;
+ OPIECE *p;
+ size_t j;
+
+ t = pl->t;
+ for (j=0;(j<n)&&(t->roots[i+j]==ALL);j++) ;
+ if ((j == n) || ((n > 1) && (t->fanout-k >= pl->split)))
+  { p = plan_piece(pl);
+    p->n = (j == n) ? ALL : NONE;
+    p->v = (t->fanout ? (unsigned long int)i << (32-t->fanout) : 0);
+    p->bit = 31 - (t->fanout - k);
+    p->slot = i;
+    p->nslots = n;
+    p->k = k;
+    return;
+  }
+ if (n == 1)
+  { plan_node(pl,t->roots[i],(t->fanout ? (unsigned long int)i << (32-t->fanout) : 0),31-t->fanout);
+    return;
+  }
+ plan_slots(pl,i,n/2,k-1);
+ plan_slots(pl,i+(n/2),n/2,k-1);
+}
+
+/*
+ * Take the next piece to format, waiting, if wait is set, for limit
+ *  to let us have it; pl->n if there are none left (or, without wait,
+ *  none we may have yet).
+ */
+static size_t out_next(OPLAN *pl, int wait)
+{
+ size_t i;
+
+ pthread_mutex_lock(&pl->lock);
+ while (wait && (pl->next >= pl->limit) && (pl->next < pl->n)) pthread_cond_wait(&pl->more,&pl->lock);
+ i = (pl->next < pl->limit) ? pl->next++ : pl->n;
+ pthread_mutex_unlock(&pl->lock);
+ return(i);
+}
+
+static void out_piece(OPLAN *pl, OUTBUF *o, size_t i)
+{
+ OPIECE *p;
+
+ p = &pl->p[i];
+ o->mem = 0;
+ o->mlen = 0;
+ o->mmax = 0;
+ if (p->nslots && (p->n == NONE)) walk_slots(pl->t,p->slot,p->nslots,p->k,pl->fn,o);
+ else dump_tree(pl->t,p->n,p->v,p->bit,pl->fn,o);
+ out_flush(o);
+ pthread_mutex_lock(&pl->lock);
+ p->mem = o->mem;
+ p->len = o->mlen;
+ p->done = 1;
+ pthread_cond_signal(&pl->done);
+ pthread_mutex_unlock(&pl->lock);
+}
+
+static OUTBUF *out_membuf(void)
+{
+ OUTBUF *o;
+
+ o = malloc(sizeof(OUTBUF));
+ if (o == 0) nomem();
+ o->len = 0;
+ o->to_mem = 1;
+ return(o);
+}
+
+static void *out_job(void *arg)
+{
+ OPLAN *pl;
+ OUTBUF *o;
+ size_t i;
+
+ pl = arg;
+ o = out_membuf();
+ while ((i = out_next(pl,1)) < pl->n) out_piece(pl,o,i);
+ free(o);
+ return(0);
+}
+
+/*
+ * Write out n buffers, in order, a batch of them per writev.
+ */
+static void out_writev(OPIECE *p, size_t n)
+{
+ struct iovec iov[OUT_IOV];
+ size_t i;
+ int skip;
+ int niov;
+ ssize_t r;
+
+ for (i=0;i<n;)
+  { for (niov=0;(i<n)&&(niov<OUT_IOV);i++)
+     { if (p[i].len == 0) continue;
+       iov[niov].iov_base = p[i].mem;
+       iov[niov].iov_len = p[i].len;
+       niov ++;
+     }
+    skip = 0;
+    while (skip < niov)
+     { r = writev(out.fd,&iov[skip],niov-skip);
+       if (r < 0)
+        { if (errno == EINTR) continue;
+          fprintf(stderr,"%s: write error: %s\n",__progname,strerror(errno));
+          exit(1);
+        }
+       for (;(skip<niov)&&((size_t)r>=iov[skip].iov_len);skip++) r -= iov[skip].iov_len;
+       if (skip < niov)
+        { iov[skip].iov_base = (char *)iov[skip].iov_base + r;
+          iov[skip].iov_len -= r;
+        }
      }
   }
- switch (state)
-  { default:
-       abort();
-       break;
-    case 1:
-       break;
-    case 2 ... 7:
-    case 10 ... 16:
-       if (n >= 0) fprintf(stderr,"%s: line %d: EOF at an inappropriate place\n",__progname,line);
-       break;
-    case 8:
-       if (n >= 0) save_one_addr((a<<8)|n);
-       break;
-    case 9:
-       if (n >= 0) save_one_addr(a);
-       break;
-    case 17:
-       if (n >= 0) save_range(a1,(a<<8)|n);
-       break;
+}
+
+static int dump_parallel(void *set)
+{
+ TREE *t;
+ OPLAN pl;
+ OUTBUF *o;
+ pthread_t *tid;
+ size_t wave;
+ size_t end;
+ size_t i;
+ size_t k;
+ int split;
+ int nw;
+ int j;
+
+ if ((jobs < 2) || (engine->create != &tree_create)) return(0);
+ t = set;
+ tree_flush(t);
+ if ((t->nruns > 0) || (t->pool.used < OUT_MIN_NODES)) return(0);
+ for (split=0;(1<<split)<jobs*64;split++) ;
+ if (split < OUT_SPLIT_BITS) split = OUT_SPLIT_BITS;
+ pl.t = t;
+ pl.fn = out_fn;
+ pl.p = 0;
+ pl.n = 0;
+ pl.max = 0;
+ pl.split = split;
+ plan_slots(&pl,0,t->nroots,t->fanout);
+ wave = OUT_WAVE * jobs;
+ pl.next = 0;
+ pl.limit = (wave < pl.n) ? wave : pl.n;
+ pthread_mutex_init(&pl.lock,0);
+ pthread_cond_init(&pl.more,0);
+ pthread_cond_init(&pl.done,0);
+ tid = malloc(jobs*sizeof(pthread_t));
+ if (tid == 0) nomem();
+ out_flush(&out);
+ for (nw=0,j=0;j<jobs;j++)
+  { if (! pthread_create(&tid[nw],0,&out_job,&pl)) nw ++;
   }
+ o = nw ? 0 : out_membuf();
+ for (i=0;i<pl.n;i=end)
+  { end = (i + wave < pl.n) ? i + wave : pl.n;
+    if (o)
+     { while ((k = out_next(&pl,0)) < pl.n) out_piece(&pl,o,k);
+     }
+    pthread_mutex_lock(&pl.lock);
+    for (k=i;k<end;k++)
+     { while (! pl.p[k].done) pthread_cond_wait(&pl.done,&pl.lock);
+     }
+    pl.limit = (end + wave < pl.n) ? end + wave : pl.n;
+    pthread_cond_broadcast(&pl.more);
+    pthread_mutex_unlock(&pl.lock);
+    out_writev(&pl.p[i],end-i);
+    for (k=i;k<end;k++) free(pl.p[k].mem);
+  }
+ for (j=0;j<nw;j++) pthread_join(tid[j],0);
+ free(o);
+ free(tid);
+ pthread_mutex_destroy(&pl.lock);
+ pthread_cond_destroy(&pl.more);
+ pthread_cond_destroy(&pl.done);
+ free(pl.p);
+ return(1);
 }
 
 /*
  * After accumulating all input, dump out the resulting CIDR blocks.
- *  Because we collapse when possible during tree construction, there
- *  is nothing to do here but call dump_tree to walk the tree and print
- *  a line when it finds an ALL node.
+ *  Because every engine collapses when possible while it builds,
+ *  there is nothing to do here but have it walk what it built and
+ *  print a line for each block it finds (in parallel, if we can).  The
+ *  IPv6 blocks, if any, come after all the IPv4 ones.
+ */
+static void dump_output(void *set, void *set6)
+{
+ if (! dump_parallel(set)) (*engine->walk)(set,out_fn,&out);
+ if (set6) trie_walk6(set6,&out_block6,&out);
+ out_flush(&out);
+}
+
+/*
+ * The blocks queried by --within (or the daemon's within and count),
+ *  which can be anything the input can be: the parser reads them, with
+ *  an engine whose "set" is the QLIST, into a list of blocks, ranges
+ *  being split up as usual.
+ */
+typedef struct qblock QBLOCK;
+typedef struct qlist QLIST;
+
+struct qblock {
+  unsigned long int a;
+  int w;
+  } ;
+
+struct qlist {
+  QBLOCK *b;
+  size_t n;
+  size_t max;
+  } ;
+
+static void qlist_block(void *set, unsigned long int a, int w)
+{
+ QLIST *q;
+
+ q = set;
+ if (q->n >= q->max)
+  { q->max = q->max ? q->max * 2 : 16;
+    q->b = realloc(q->b,q->max*sizeof(q->b[0]));
+    if (q->b == 0) nomem();
+  }
+ q->b[q->n].a = a;
+ q->b[q->n].w = w;
+ q->n ++;
+}
+
+static void qlist_range(void *set, unsigned long int a1, unsigned long int a2)
+{
+ split_range(a1,a2,&qlist_block,set);
+}
+
+static ENGINE qlist_engine = { "query", 0, &qlist_block, &qlist_range };
+
+/*
+ * Parse the len bytes at s into q; complaints go to err, prefixed with
+ *  name if it isn't nil, and the number of them is returned.
+ */
+static int qlist_parse(QLIST *q, const char *name, const char *s, size_t len, FILE *err, int line)
+{
+ PARSER p;
+
+ parse_init(&p,name,q);
+ p.e = &qlist_engine;
+ p.err = err;
+ p.format = FMT_TEXT;
+ p.line = line;
+ parse_block(&p,(const unsigned char *)s,len);
+ parse_end(&p);
+ return(p.errors);
+}
+
+/*
+ * Print the part of the set within each of the blocks in q, in turn,
+ *  to o with fn, or, if count is set, just the number of addresses in
+ *  the set that are within them (counted once for each block that
+ *  they're in); with no blocks at all, that's the whole set.
+ */
+static void dump_query(void *set, QLIST *q, int count, BLOCKFN fn, OUTBUF *o)
+{
+ uint64_t c;
+ size_t i;
+
+ if (q->n == 0) qlist_block(q,0,0);
+ c = 0;
+ for (i=0;i<q->n;i++)
+  { if (count) c += query_count(engine,set,q->b[i].a,q->b[i].w);
+    else query_walk(engine,set,q->b[i].a,q->b[i].w,fn,o);
+  }
+ if (count)
+  { if (o->len > sizeof(o->buf)-32) out_flush(o);
+    o->len += sprintf(&o->buf[o->len],"%llu\n",(unsigned long long int)c);
+  }
+ out_flush(o);
+}
+
+/*
+ * Aggregation with tolerance, for --max-blocks.  Sometimes the minimal
+ *  set is still too many blocks (for a hardware table, say), and it's
+ *  better to cover some addresses that weren't asked for than to go
+ *  over.  So we take the minimal blocks (by walking the set, so any
+ *  engine will do) and build the binary trie they're the leaves of:
+ *  each internal node is the longest prefix two neighbouring blocks
+ *  share, and since the blocks are disjoint and sorted, one pass with
+ *  a stack of the rightmost path builds it.  Then, while there are too
+ *  many blocks, we replace the pair of sibling blocks whose common
+ *  prefix covers the fewest addresses not already covered by a single
+ *  block, that prefix.  Each such merge costs one block, and is only
+ *  possible once both of a node's subtrees are down to a block each,
+ *  so the candidates are kept in a heap ordered by cost (and then by
+ *  address, so the result doesn't depend on how the heap happens to
+ *  break ties); merging a node can only make its parent a candidate,
+ *  so each step is a heap pop and at most one push, and nothing is
+ *  ever recomputed.  Once we're within max, we still go on merging
+ *  while the cheapest merge costs nothing: earlier merges can leave
+ *  two blocks that are exactly the halves of their parent, and the
+ *  result wouldn't be minimal with them left apart.
+ *
+ * The nodes are in one array, the m blocks first and the m-1 internal
+ *  nodes after them.  sub[0] is -1 for a block - a leaf - whether it
+ *  was one to begin with or has become one by merging.
+ */
+typedef struct anode ANODE;
+typedef struct agg AGG;
+
+struct anode {
+  uint32_t key;
+  int len;
+  int32_t up;
+  int32_t sub[2];
+  } ;
+
+struct agg {
+  ANODE *n;
+  size_t nn;
+  size_t max;
+  int32_t *heap;
+  size_t nheap;
+  } ;
+
+#define ASIZE(g,i) ((uint64_t)1 << (32-(g)->n[(i)].len))
+#define ALEAF(g,i) ((g)->n[(i)].sub[0] < 0)
+#define ACOST(g,i) (ASIZE(g,i) - ASIZE(g,(g)->n[(i)].sub[0]) - ASIZE(g,(g)->n[(i)].sub[1]))
+#define ABEFORE(g,i,j) ((ACOST(g,i) < ACOST(g,j)) || ((ACOST(g,i) == ACOST(g,j)) && ((g)->n[(i)].key < (g)->n[(j)].key)))
+
+static void agg_block(void *arg, unsigned long int v, int w)
+{
+ AGG *g;
+
+ g = arg;
+ if (g->nn >= g->max)
+  { g->max = g->max ? g->max * 2 : 1024;
+    g->n = realloc(g->n,g->max*sizeof(ANODE));
+    if (g->n == 0) nomem();
+  }
+ g->n[g->nn].key = v;
+ g->n[g->nn].len = w;
+ g->n[g->nn].up = -1;
+ g->n[g->nn].sub[0] = -1;
+ g->n[g->nn].sub[1] = -1;
+ g->nn ++;
+}
+
+static void agg_push(AGG *g, int32_t v)
+{
+ size_t i;
+
+ for (i=g->nheap++;(i>0)&&ABEFORE(g,v,g->heap[(i-1)/2]);i=(i-1)/2) g->heap[i] = g->heap[(i-1)/2];
+ g->heap[i] = v;
+}
+
+static int32_t agg_pop(AGG *g)
+{
+ int32_t v;
+ int32_t last;
+ size_t i;
+ size_t c;
+
+ v = g->heap[0];
+ last = g->heap[--g->nheap];
+ for (i=0;(c=(2*i)+1)<g->nheap;i=c)
+  { if ((c+1 < g->nheap) && ABEFORE(g,g->heap[c+1],g->heap[c])) c ++;
+    if (! ABEFORE(g,g->heap[c],last)) break;
+    g->heap[i] = g->heap[c];
+  }
+ g->heap[i] = last;
+ return(v);
+}
+
+/*
+ * Build the trie over the m blocks in n[0..m-1]; returns the root.
+ *  The stack holds the rightmost path, shortest prefix at the bottom,
+ *  so it's never deeper than 33.
+ */
+static int32_t agg_build(AGG *g, size_t m)
+{
+ int32_t stack[34];
+ int sp;
+ int32_t last;
+ int32_t v;
+ uint32_t x;
+ size_t i;
+ int l;
+
+ sp = 0;
+ stack[sp++] = 0;
+ for (i=1;i<m;i++)
+  { x = g->n[i-1].key ^ g->n[i].key;
+    l = __builtin_clz(x);
+    v = m + i - 1;
+    g->n[v].key = l ? g->n[i].key & (0xffffffff << (32-l)) : 0;
+    g->n[v].len = l;
+    for (last=-1;(sp>0)&&(g->n[stack[sp-1]].len>l);) last = stack[--sp];
+    g->n[v].sub[0] = last;
+    g->n[last].up = v;
+    if (sp > 0)
+     { g->n[stack[sp-1]].sub[1] = v;
+       g->n[v].up = stack[sp-1];
+     }
+    else g->n[v].up = -1;
+    g->n[v].sub[1] = i;
+    g->n[i].up = v;
+    stack[sp++] = v;
+    stack[sp++] = i;
+  }
+ return(stack[0]);
+}
+
+static void agg_dump(AGG *g, int32_t v)
+{
+ if (ALEAF(g,v))
+  { (*out_fn)(&out,g->n[v].key,g->n[v].len);
+    return;
+  }
+ agg_dump(g,g->n[v].sub[0]);
+ agg_dump(g,g->n[v].sub[1]);
+}
+
+/*
+ * Print set in at most max blocks, and then say how many addresses
+ *  that cost.
+ */
+static void dump_aggregated(void *set, long int max)
+{
+ AGG g;
+ size_t m;
+ size_t nb;
+ size_t i;
+ int32_t root;
+ int32_t v;
+ int32_t p;
+ uint64_t over;
+
+ g.n = 0;
+ g.nn = 0;
+ g.max = 0;
+ (*engine->walk)(set,&agg_block,&g);
+ m = g.nn;
+ over = 0;
+ if (m > 1)
+  { if (m > INT32_MAX/2)
+     { fprintf(stderr,"%s: too many blocks for --max-blocks\n",__progname);
+       exit(1);
+     }
+    g.n = realloc(g.n,((2*m)-1)*sizeof(ANODE));
+    g.heap = malloc(m*sizeof(int32_t));
+    if ((g.n == 0) || (g.heap == 0)) nomem();
+    g.nheap = 0;
+    root = agg_build(&g,m);
+    for (i=m;i<(2*m)-1;i++)
+     { if (ALEAF(&g,g.n[i].sub[0]) && ALEAF(&g,g.n[i].sub[1])) agg_push(&g,i);
+     }
+    for (nb=m;(g.nheap>0)&&((nb>max)||(ACOST(&g,g.heap[0])==0));nb--)
+     { v = agg_pop(&g);
+       over += ACOST(&g,v);
+       g.n[v].sub[0] = -1;
+       g.n[v].sub[1] = -1;
+       p = g.n[v].up;
+       if ((p >= 0) && ALEAF(&g,g.n[p].sub[0]) && ALEAF(&g,g.n[p].sub[1])) agg_push(&g,p);
+     }
+    agg_dump(&g,root);
+    free(g.heap);
+  }
+ else if (m == 1) agg_dump(&g,0);
+ out_flush(&out);
+ free(g.n);
+ fprintf(stderr,"%s: %llu addresses covered that weren't in the input\n",__progname,(unsigned long long int)over);
+}
+
+/*
+ * The daemon, for --listen.  Rather than being run again over the
+ *  whole list every time a few entries change, we keep the set and
+ *  take changes on a Unix-domain stream socket.  The protocol is lines
+ *  of text, one command per line:
+ *
+ *      add input       add the addresses, ranges, and blocks in input,
+ *                      which is anything that could appear in a file
+ *      remove input    take them out again
+ *      dump            send the current minimal set of blocks
+ *      within input    send the part of it inside the blocks in input
+ *      count input     send how many addresses that is
+ *
+ * The reply to each command is whatever complaints it produced (or,
+ *  for dump and within, the blocks, one per line, just as we'd print
+ *  them, and for count the number) and then a line reading "ok".
+ *  Since add and remove go straight to the engine's add_block and
+ *  remove_block, an update costs about what adding that much input
+ *  would, however large the set is; only dump has to look at all of
+ *  it, since within and count go down only to the blocks asked about
+ *  (see tree_count).
+ *
+ * Clients are served one command at a time, from a single thread, so
+ *  the set needs no locking; a poll(2) loop just notices which clients
+ *  have something for us.  Each client's input accumulates in a buffer
+ *  of its own until it has a complete line.  Replies are made in
+ *  memory and written without blocking, as much as the socket will
+ *  take; whatever's left waits in the client's out until poll says we
+ *  can write more, and until it's all gone we neither run that
+ *  client's next command nor read any more from it.  So a client that
+ *  doesn't read its replies holds up nobody but itself, and costs us
+ *  no more than one reply's worth of memory.  A client that sends a
+ *  line longer than MAX_CMD, or that we get a write error on, is
+ *  dropped; one that closes its end is dropped once it's been sent the
+ *  replies to everything it sent before that.
+ */
+#define MAX_CMD (1 << 20)
+#define MAX_CLIENTS 64
+
+typedef struct client CLIENT;
+
+struct client {
+  int fd;
+  int line;
+  int eof;
+  char *buf;
+  size_t len;
+  size_t max;
+  size_t scan;
+  char *out;
+  size_t olen;
+  size_t odone;
+  } ;
+
+static OUTBUF reply = { -1, 0, 1 };
+
+static void reply_str(const char *s, size_t len)
+{
+ size_t n;
+
+ while (len > 0)
+  { if (reply.len == sizeof(reply.buf)) out_flush(&reply);
+    n = sizeof(reply.buf) - reply.len;
+    if (n > len) n = len;
+    memcpy(&reply.buf[reply.len],s,n);
+    reply.len += n;
+    s += n;
+    len -= n;
+  }
+}
+
+/*
+ * Run one command, the len bytes at s (without the newline), for
+ *  client c, leaving the reply in c's out.
+ */
+static void daemon_command(CLIENT *c, void *set, char *s, size_t len)
+{
+ PARSER p;
+ QLIST q;
+ FILE *err;
+ char *eb;
+ size_t el;
+ size_t i;
+ size_t k;
+ int count;
+
+ for (i=0;(i<len)&&((s[i]==' ')||(s[i]=='\t')||(s[i]=='\r'));i++) ;
+ for (k=i;(k<len)&&(s[k]!=' ')&&(s[k]!='\t')&&(s[k]!='\r');k++) ;
+ if (k == i) return;
+ if ((k-i == 4) && !memcmp(s+i,"dump",4))
+  { (*engine->walk)(set,&out_block,&reply);
+  }
+ else if (((k-i == 3) && !memcmp(s+i,"add",3)) || ((k-i == 6) && !memcmp(s+i,"remove",6)))
+  { parse_init(&p,0,set);
+    p.remove = (k-i == 6);
+    p.format = FMT_TEXT;
+    p.line = c->line;
+    p.err = open_memstream(&eb,&el);
+    if (p.err == 0) nomem();
+    parse_block(&p,(unsigned char *)s+k,len-k);
+    parse_end(&p);
+    fclose(p.err);
+    reply_str(eb,el);
+    free(eb);
+  }
+ else if (((k-i == 6) && !memcmp(s+i,"within",6)) || ((k-i == 5) && !memcmp(s+i,"count",5)))
+  { count = (k-i == 5);
+    q.b = 0;
+    q.n = 0;
+    q.max = 0;
+    err = open_memstream(&eb,&el);
+    if (err == 0) nomem();
+    if (qlist_parse(&q,0,s+k,len-k,err,c->line) == 0) dump_query(set,&q,count,&out_block,&reply);
+    fclose(err);
+    reply_str(eb,el);
+    free(eb);
+    free(q.b);
+  }
+ else
+  { reply_str("error: unknown command\n",23);
+  }
+ reply_str("ok\n",3);
+ out_flush(&reply);
+ c->out = reply.mem;
+ c->olen = reply.mlen;
+ c->odone = 0;
+ reply.mem = 0;
+ reply.mlen = 0;
+ reply.mmax = 0;
+}
+
+/*
+ * Write as much of client c's out as it will take now, returning
+ *  nonzero on a write error.  Once it's all gone, out is nil again.
+ */
+static int daemon_write(CLIENT *c)
+{
+ ssize_t r;
+
+ while (c->odone < c->olen)
+  { r = write(c->fd,c->out+c->odone,c->olen-c->odone);
+    if (r < 0)
+     { if (errno == EINTR) continue;
+       return((errno != EAGAIN) && (errno != EWOULDBLOCK));
+     }
+    c->odone += r;
+  }
+ free(c->out);
+ c->out = 0;
+ return(0);
+}
+
+/*
+ * Run the complete commands in client c's buffer, one at a time, for
+ *  as long as each reply can be written straight away; scan is how far
+ *  we've already looked for a newline.  Once c has closed its end and
+ *  no reply is waiting, any last command without a newline is run too.
+ *  Return nonzero if c should be dropped, whether because it's done or
+ *  because something went wrong.
+ */
+static int daemon_run(CLIENT *c, void *set)
+{
+ size_t i;
+ size_t done;
+
+ for (done=0,i=c->scan;(i<c->len)&&!c->out;i++)
+  { if (c->buf[i] != '\n') continue;
+    daemon_command(c,set,c->buf+done,i-done);
+    c->line ++;
+    done = i + 1;
+    if (c->out && daemon_write(c)) return(1);
+  }
+ c->len -= done;
+ memmove(c->buf,c->buf+done,c->len);
+ c->scan = i - done;
+ if (! c->eof || c->out) return(0);
+ if (c->len > 0)
+  { daemon_command(c,set,c->buf,c->len);
+    c->len = 0;
+    c->scan = 0;
+    if (c->out && daemon_write(c)) return(1);
+  }
+ return(c->out == 0);
+}
+
+/*
+ * Read what client c has sent, and run what commands we can.  Return
+ *  nonzero if c should be dropped.
+ */
+static int daemon_read(CLIENT *c, void *set)
+{
+ ssize_t r;
+ char *nb;
+
+ if (c->len == c->max)
+  { if (c->max >= MAX_CMD) return(1);
+    c->max = c->max ? c->max * 2 : 4096;
+    nb = realloc(c->buf,c->max);
+    if (nb == 0) nomem();
+    c->buf = nb;
+  }
+ r = read(c->fd,c->buf+c->len,c->max-c->len);
+ if (r < 0) return((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK));
+ if (r == 0) c->eof = 1;
+ else c->len += r;
+ return(daemon_run(c,set));
+}
+
+static void daemon_loop(const char *path, void *set)
+{
+ struct sockaddr_un sa;
+ struct stat stb;
+ struct pollfd pfd[MAX_CLIENTS+1];
+ CLIENT cl[MAX_CLIENTS];
+ int drop;
+ int nc;
+ int ls;
+ int fd;
+ int i;
+
+ if (strlen(path) >= sizeof(sa.sun_path))
+  { fprintf(stderr,"%s: %s: socket path too long\n",__progname,path);
+    exit(1);
+  }
+ memset(&sa,0,sizeof(sa));
+ sa.sun_family = AF_UNIX;
+ strcpy(&sa.sun_path[0],path);
+ if ((lstat(path,&stb) == 0) && S_ISSOCK(stb.st_mode)) unlink(path);
+ ls = socket(AF_UNIX,SOCK_STREAM,0);
+ if ((ls < 0) || (bind(ls,(struct sockaddr *)&sa,sizeof(sa)) < 0) || (listen(ls,16) < 0))
+  { fprintf(stderr,"%s: %s: %s\n",__progname,path,strerror(errno));
+    exit(1);
+  }
+ signal(SIGPIPE,SIG_IGN);
+ nc = 0;
+ while (1)
+  { pfd[0].fd = ls;
+    pfd[0].events = (nc < MAX_CLIENTS) ? POLLIN : 0;
+    for (i=0;i<nc;i++)
+     { pfd[i+1].fd = cl[i].fd;
+       pfd[i+1].events = cl[i].out ? POLLOUT : POLLIN;
+     }
+    if (poll(&pfd[0],nc+1,-1) < 0)
+     { if (errno == EINTR) continue;
+       fprintf(stderr,"%s: poll: %s\n",__progname,strerror(errno));
+       exit(1);
+     }
+    for (i=nc-1;i>=0;i--)
+     { if (! (pfd[i+1].revents & (POLLIN|POLLOUT|POLLHUP|POLLERR))) continue;
+       if (cl[i].out) drop = daemon_write(&cl[i]) || (! cl[i].out && daemon_run(&cl[i],set));
+       else drop = daemon_read(&cl[i],set);
+       if (drop)
+        { close(cl[i].fd);
+          free(cl[i].buf);
+          free(cl[i].out);
+          cl[i] = cl[--nc];
+        }
+     }
+    if (pfd[0].revents & POLLIN)
+     { fd = accept(ls,0,0);
+       if (fd >= 0)
+        { fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0)|O_NONBLOCK);
+          cl[nc].fd = fd;
+          cl[nc].line = 1;
+          cl[nc].eof = 0;
+          cl[nc].buf = 0;
+          cl[nc].len = 0;
+          cl[nc].max = 0;
+          cl[nc].scan = 0;
+          cl[nc].out = 0;
+          nc ++;
+        }
+     }
+  }
+}
+
+static void usage(void)
+{
+ fprintf(stderr,"usage: %s [--engine=tree|trie|sort] [--sorted] [--fanout=0|8|16] [-j jobs] [--readers=n]\n\t[--combine=union|intersect|xor] [--exclude=file] [--listen=path | --lookup | --max-blocks=n]\n\t[--max-mem=megabytes] [--save-state=file] [--load-state=file]\n\t[--in-format=text|bin32|binrange] [--out-format=text|binprefix]\n\t[--byte-order=big|little] [--collapse=eager|lazy] [--within=block] [--count]\n\t[--stats] [file ...]\n",__progname);
+ exit(1);
+}
+
+static void set_engine(const char *name)
+{
+ for (engine=&engines[0];engine->name;engine++)
+  { if (! strcmp(engine->name,name)) return;
+  }
+ fprintf(stderr,"%s: unknown engine %s\n",__progname,name);
+ usage();
+}
+
+/*
+ * Parse a number option; anything but an integer from min to max is a
+ *  usage error.
  */
-static void dump_output(void)
+static long int num_arg(const char *s, long int min, long int max)
 {
- dump_tree(root,0,31);
+ char *e;
+ long int v;
+
+ errno = 0;
+ v = strtol(s,&e,10);
+ if ((e == s) || *e || errno || (v < min) || (v > max)) usage();
+ return(v);
 }
 
 /*
  * By this point, main() is pretty much trivial.
  */
-int main(void);
-int main(void)
+int main(int, char **);
+int main(int ac, char **av)
 {
- root = NONE;
- read_input();
- dump_output();
+ void *set;
+ void *set6;
+ void *ex;
+ const char *listen_path;
+ const char *save_path;
+ const char *load_path;
+ int lookup;
+ long int maxblocks;
+ long int maxmem;
+ LOOKUP *l;
+ char **excl;
+ int nexcl;
+ QLIST within;
+ int nwithin;
+ int count;
+ int op;
+ int i;
+
+ listen_path = 0;
+ save_path = 0;
+ load_path = 0;
+ lookup = 0;
+ maxblocks = 0;
+ maxmem = 0;
+ excl = malloc(ac*sizeof(char *));
+ if (excl == 0) nomem();
+ nexcl = 0;
+ within.b = 0;
+ within.n = 0;
+ within.max = 0;
+ nwithin = 0;
+ count = 0;
+ op = -1;
+ for (i=1;i<ac;i++)
+  { if ((av[i][0] != '-') || (av[i][1] == '\0')) break;
+    if (! strcmp(av[i],"--"))
+     { i ++;
+       break;
+     }
+    if (! strncmp(av[i],"--engine=",9)) set_engine(av[i]+9);
+    else if (! strcmp(av[i],"--sorted")) set_engine("sorted");
+    else if (! strncmp(av[i],"--fanout=",9))
+     { fanout = num_arg(av[i]+9,0,16);
+       if (fanout % 8) usage();
+     }
+    else if (! strcmp(av[i],"-j"))
+     { if (++i >= ac) usage();
+       jobs = num_arg(av[i],1,1024);
+     }
+    else if (! strncmp(av[i],"-j",2)) jobs = num_arg(av[i]+2,1,1024);
+    else if (! strncmp(av[i],"--readers=",10)) readers = num_arg(av[i]+10,1,MAX_READERS);
+    else if (! strncmp(av[i],"--listen=",9) && av[i][9]) listen_path = av[i] + 9;
+    else if (! strcmp(av[i],"--lookup")) lookup = 1;
+    else if (! strncmp(av[i],"--save-state=",13) && av[i][13]) save_path = av[i] + 13;
+    else if (! strncmp(av[i],"--load-state=",13) && av[i][13]) load_path = av[i] + 13;
+    else if (! strncmp(av[i],"--max-blocks=",13)) maxblocks = num_arg(av[i]+13,1,INT32_MAX);
+    else if (! strncmp(av[i],"--max-mem=",10)) maxmem = num_arg(av[i]+10,1,1048576);
+    else if (! strcmp(av[i],"--in-format=text")) in_format = FMT_TEXT;
+    else if (! strcmp(av[i],"--in-format=bin32")) in_format = FMT_BIN32;
+    else if (! strcmp(av[i],"--in-format=binrange")) in_format = FMT_BINRANGE;
+    else if (! strcmp(av[i],"--out-format=text")) out_fn = &out_block;
+    else if (! strcmp(av[i],"--out-format=binprefix")) out_fn = &out_prefix;
+    else if (! strcmp(av[i],"--byte-order=big")) little_endian = 0;
+    else if (! strcmp(av[i],"--byte-order=little")) little_endian = 1;
+    else if (! strncmp(av[i],"--exclude=",10) && av[i][10]) excl[nexcl++] = av[i] + 10;
+    else if (! strncmp(av[i],"--within=",9) && av[i][9])
+     { if (qlist_parse(&within,"--within",av[i]+9,strlen(av[i]+9),stderr,1)) exit(1);
+       nwithin ++;
+     }
+    else if (! strcmp(av[i],"--count")) count = 1;
+    else if (! strcmp(av[i],"--combine=union")) op = OP_UNION;
+    else if (! strcmp(av[i],"--combine=intersect")) op = OP_INTERSECT;
+    else if (! strcmp(av[i],"--combine=xor")) op = OP_XOR;
+    else if (! strcmp(av[i],"--collapse=eager")) lazy_collapse = 0;
+    else if (! strcmp(av[i],"--collapse=lazy")) lazy_collapse = 1;
+    else if (! strcmp(av[i],"--stats"))
+     {
+#ifdef STATS
+       stats.on = 1;
+#else
+       fprintf(stderr,"%s: --stats needs a build with -DSTATS\n",__progname);
+       exit(1);
+#endif
+     }
+    else usage();
+  }
+ if (lookup && (listen_path || (i >= ac))) usage();
+ if (maxblocks && (listen_path || lookup)) usage();
+ if (maxmem && ((op >= 0) || nexcl || listen_path)) usage();
+ if ((save_path || load_path) && ((op >= 0) || maxmem)) usage();
+ if ((nwithin || count) && (listen_path || lookup || maxblocks)) usage();
+ if (lookup && engine->streams)
+  { fprintf(stderr,"%s: the %s engine can't be used with --lookup\n",__progname,engine->name);
+    exit(1);
+  }
+ if (maxblocks && engine->streams)
+  { fprintf(stderr,"%s: the %s engine can't be used with --max-blocks\n",__progname,engine->name);
+    exit(1);
+  }
+ if ((nwithin || count) && engine->streams)
+  { fprintf(stderr,"%s: the %s engine can't be used with %s\n",__progname,engine->name,count?"--count":"--within");
+    exit(1);
+  }
+ if (maxmem && (engine->create != &tree_create))
+  { fprintf(stderr,"%s: the %s engine can't be used with --max-mem\n",__progname,engine->name);
+    exit(1);
+  }
+ if (lazy_collapse && (engine->create != &tree_create))
+  { fprintf(stderr,"%s: the %s engine can't be used with --collapse=lazy\n",__progname,engine->name);
+    exit(1);
+  }
+ if (save_path && (engine->create != &tree_create))
+  { fprintf(stderr,"%s: the %s engine can't be used with --save-state\n",__progname,engine->name);
+    exit(1);
+  }
+ if (load_path && (engine->create != &tree_create))
+  { fprintf(stderr,"%s: the %s engine can't be used with --load-state\n",__progname,engine->name);
+    exit(1);
+  }
+ if (maxmem)
+  { maxmem = ((maxmem << 20) / sizeof(NODE)) / jobs;
+    max_nodes = (maxmem < 65536) ? 65536 : (maxmem > 0xf0000000) ? 0xf0000000 : maxmem;
+  }
+ if ((op >= 0) && !engine->combine)
+  { fprintf(stderr,"%s: the %s engine can't be used with --combine\n",__progname,engine->name);
+    exit(1);
+  }
+ if (nexcl && !engine->subtract)
+  { fprintf(stderr,"%s: the %s engine can't be used with --exclude\n",__progname,engine->name);
+    exit(1);
+  }
+ if (listen_path && !engine->remove_block)
+  { fprintf(stderr,"%s: the %s engine can't be used with --listen\n",__progname,engine->name);
+    exit(1);
+  }
+ STAT(stat_phase(0));
+ set6 = 0;
+ if ((op < 0) && !nexcl && !listen_path && !lookup && !maxblocks && !save_path && !nwithin && !count && (out_fn == &out_block) && (in_format == FMT_TEXT))
+  { set6 = trie_create6();
+  }
+ if (op >= 0)
+  { set = combine_input(av+i,ac-i,op);
+  }
+ else
+  { set = load_path ? load_state(load_path) : (*engine->create)();
+    if (! listen_path) read_input(av+i,ac-i,set,set6);
+    else if (i < ac) read_input(av+i,ac-i,set,0);
+  }
+ STAT(stat_phase("read"));
+ if (nexcl)
+  { ex = (*engine->create)();
+    read_input(excl,nexcl,ex,0);
+    (*engine->subtract)(set,ex);
+    STAT(stat_phase("exclude"));
+  }
+ if (save_path)
+  { save_state(save_path,set);
+    STAT(stat_phase("save"));
+  }
+ if (listen_path) daemon_loop(listen_path,set);
+ if (lookup)
+  { l = lookup_build(engine,set);
+    STAT(stat_phase("lookup build"));
+    STAT(stat_set(set));
+    (*engine->destroy)(set);
+    engine = &query_engine;
+    read_file("-",l,0);
+    out_flush(&out);
+    lookup_free(l);
+    STAT(stat_phase("queries"));
+    STAT(stat_report());
+    exit(0);
+  }
+ if (maxblocks) dump_aggregated(set,maxblocks);
+ else if (nwithin || count) dump_query(set,&within,count,out_fn,&out);
+ else dump_output(set,set6);
+ STAT(stat_phase("output"));
+ STAT(stat_set(set));
+ STAT(stat_report());
+ (*engine->destroy)(set);
+ if (set6) trie_destroy6(set6);
  exit(0);
 }
 
+#endif
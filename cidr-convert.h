@@ -0,0 +1,86 @@
+/*
+ * The library interface to the CIDR block calculator, for building
+ *  cidr-convert.c with -DNO_MAIN and linking it into another program.
+ *
+ * A cidr_set is a set of IPv4 addresses, kept by one of the engines
+ *  (see the --engine option).  Addresses are host-order uint32_ts.
+ *  Whatever is added, the set is always held as the minimal set of
+ *  CIDR blocks covering it, which cidr_set_walk hands back in order.
+ *  A cidr_lookup is a snapshot of a set flattened for fast membership
+ *  tests; it doesn't change when the set does.
+ *
+ * Nothing here is safe to use on one set from more than one thread at
+ *  once, but separate sets are independent.  Running out of memory is
+ *  fatal.
+ *
+ * This file is in the public domain.
+ */
+
+#ifndef CIDR_CONVERT_H
+#define CIDR_CONVERT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct cidr_set cidr_set;
+typedef struct cidr_lookup cidr_lookup;
+
+/* Called for each block, with its address and its width (the /number). */
+typedef void (*cidr_block_fn)(void *, uint32_t, int);
+
+/*
+ * Make a new, empty set kept by the named engine ("tree", "trie", or
+ *  "sort"; nil means the default).  Returns nil if there's no such
+ *  engine, or if it's one that can't keep a set (such as "sorted").
+ */
+extern cidr_set *cidr_set_new(const char *);
+extern void cidr_set_free(cidr_set *);
+
+/*
+ * Add an address; a range, inclusive; or a CIDR block, whose host bits
+ *  needn't be clear.  A reversed range or a width over 32 returns -1
+ *  and adds nothing; otherwise they return 0.
+ */
+extern void cidr_set_add_addr(cidr_set *, uint32_t);
+extern int cidr_set_add_range(cidr_set *, uint32_t, uint32_t);
+extern int cidr_set_add_cidr(cidr_set *, uint32_t, int);
+
+/*
+ * Batch versions: add n addresses, or the n ranges from the two arrays
+ *  of starts and ends.  The ranges version returns -1 if any range was
+ *  reversed (the others are still added).
+ */
+extern void cidr_set_add_addrs(cidr_set *, const uint32_t *, size_t);
+extern int cidr_set_add_ranges(cidr_set *, const uint32_t *, const uint32_t *, size_t);
+
+/*
+ * Parse text in the program's input format into the set.  Complaints
+ *  are written to the FILE, if it's not nil; the return value is how
+ *  many there were.
+ */
+extern int cidr_set_add_text(cidr_set *, const char *, size_t, FILE *);
+
+/* Add everything in the second set to the first, and free the second. */
+extern void cidr_set_merge(cidr_set *, cidr_set *);
+
+/* Call fn, with arg, on each block of the minimal set, in order. */
+extern void cidr_set_walk(cidr_set *, cidr_block_fn, void *);
+
+/*
+ * Queries of one CIDR block of a set (whose host bits needn't be
+ *  clear): call fn, with arg, on each block of the minimal set that's
+ *  inside it, in order (a block of the set that contains it comes back
+ *  as the query block itself); or count how many of its addresses are
+ *  in the set.  A tree set answers these without looking outside the
+ *  block.  A width over 32 returns -1; otherwise walk_within returns 0.
+ */
+extern int cidr_set_walk_within(cidr_set *, uint32_t, int, cidr_block_fn, void *);
+extern int64_t cidr_set_count(cidr_set *, uint32_t, int);
+
+extern cidr_lookup *cidr_lookup_new(cidr_set *);
+extern int cidr_lookup_contains(const cidr_lookup *, uint32_t);
+extern int cidr_lookup_contains_range(const cidr_lookup *, uint32_t, uint32_t);
+extern void cidr_lookup_free(cidr_lookup *);
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * The width-generic part of the CIDR block calculator: range splitting
+ *  and the path-compressed trie, written once for any address width
+ *  and included by cidr-convert.c once for each width it handles, with
+ *  these defined first:
+ *
+ *      W_NAME(x)       the name to use for x, e.g. x for IPv4 and x##6
+ *                      for IPv6, so each inclusion has names of its own
+ *      W_BITS          the width of an address, in bits
+ *      W_KEY           an unsigned type exactly W_BITS wide, for keys
+ *      W_ADDR          the type addresses are passed around as; at
+ *                      least as wide as W_KEY
+ *      W_FN            the block callback type, taking (void *, W_ADDR,
+ *                      int)
+ *      W_ONES          W_BITS 1 bits, as a W_ADDR
+ *      W_CLZ(x)        leading zero bits in the nonzero W_KEY x
+ *      W_CTZ(x)        trailing zero bits in the nonzero W_ADDR x
+ *      W_LOG2(x)       the index of the top 1 bit of the nonzero W_ADDR
+ *                      x
+ *
+ * They, and the macros used internally, are all undefined again at
+ *  the end, ready for the next inclusion.  Each instantiation is thus
+ *  specialized for its width - the IPv4 one does its arithmetic in
+ *  machine words, and only the IPv6 one pays for 128-bit keys.
+ *
+ * This file is in the public domain.
+ */
+
+#define T(x) W_NAME(x)
+
+/*
+ * Break the range a1-a2 (inclusive) into CIDR blocks, calling fn on
+ *  each, in order, with arg.  All we do is start at the bottom of the
+ *  range and loop, each time computing the largest block that doesn't
+ *  go below the bottom, shrinking it as far as necessary to ensure it
+ *  doesn't go above the top, adding it, and moving the `bottom' value
+ *  to just above the block.  Lather, rinse, repeat...until the whole
+ *  range is covered.  If the range is maximal, so are the blocks.
+ *
+ * The block is 2^k addresses, where k is the smaller of the number of
+ *  trailing zero bits in the bottom (the alignment) and the position of
+ *  the top bit of the number of addresses left (the size that fits);
+ *  the bit-scan builtins give both directly.  We work with d, the
+ *  number left less one, since the number itself can be 2^W_BITS, and
+ *  stop when the block reaches the top, rather than when the bottom
+ *  passes it, since it may have nowhere to go.
+ */
+static void T(split_range)(W_ADDR a1, W_ADDR a2, W_FN fn, void *arg)
+{
+ W_ADDR d;
+ int k;
+ int z;
+
+ if (a1 > a2) return;
+ while (1)
+  { k = a1 ? W_CTZ(a1) : W_BITS;
+    d = a2 - a1;
+    z = (d == W_ONES) ? W_BITS : W_LOG2(d+1);
+    if (z < k) k = z;
+    (*fn)(arg,a1,W_BITS-k);
+    if ((k == W_BITS) || (d == ((W_ADDR)1 << k) - 1)) return;
+    a1 += (W_ADDR)1 << k;
+  }
+}
+
+/*
+ * The path-compressed ("trie") engine.  This is the representation
+ *  the comment on the tree says isn't worth it - and for most IPv4
+ *  input it isn't, but for sparse addresses spread over the whole
+ *  space, each isolated address costs the tree a node for every bit
+ *  and every insert that many levels of descent, and for IPv6, with
+ *  128 of them, a tree of per-bit nodes is hopeless.  Here a TNODE
+ *  stands for a whole run of levels: it carries the prefix, key/len,
+ *  that everything under it shares, and everything off that path is
+ *  implicitly NONE.  So an isolated address costs one TNODE, plus one
+ *  more where it branches off from its neighbours, and memory and
+ *  insert cost go with the number of distinct prefixes instead of with
+ *  the width times the number of addresses.
+ *
+ * The NONE/ALL conventions are the same as the tree's, with one
+ *  addition.  A link is responsible for a region - for the root, the
+ *  whole space; for sub[b] of a TNODE with prefix key/len, the
+ *  len+1-bit prefix that extends key with b.  An ALL link, as before,
+ *  means its whole region is present.  But a TNODE can sit strictly
+ *  below the region of the link that points to it, and then if
+ *  everything under it is present, it can't just become ALL, since
+ *  that would claim the part of the region it doesn't cover.  Such a
+ *  TNODE stays, with both its sub[] links ALL; that's what "full"
+ *  means, and a full TNODE is a CIDR block of its own.  (A single
+ *  address is always a full TNODE, or ALL, since it has no bits left
+ *  to branch on.)  Whenever a full TNODE's prefix does fill its link's
+ *  region, it is collapsed into ALL, exactly as the tree does.
+ *
+ * sub[] comes first so the pool's free list can thread through it.
+ */
+typedef struct T(tnode) T(TNODE);
+typedef struct T(trie) T(TRIE);
+
+struct T(tnode) {
+  NODEREF sub[2];
+  W_KEY key;
+  int len;
+  } ;
+
+struct T(trie) {
+  POOL pool;
+  T(TNODE) *tnodes;
+  NODEREF root;
+  } ;
+
+#define TMASK(l) ((l) ? (W_KEY)~(W_KEY)0 << (W_BITS-(l)) : 0)
+#define TBIT(a,l) (((a) >> (W_BITS-1-(l))) & 1)
+#define TFULL(t,n) (((t)->tnodes[n].sub[0] == ALL) && ((t)->tnodes[n].sub[1] == ALL))
+
+static NODEREF T(new_tnode)(T(TRIE) *t, W_KEY key, int len)
+{
+ NODEREF n;
+
+ n = pool_get(&t->pool);
+ t->tnodes = (T(TNODE) *) t->pool.mem;
+ t->tnodes[n].key = key & TMASK(len);
+ t->tnodes[n].len = len;
+ return(n);
+}
+
+static void T(free_trie)(T(TRIE) *t, NODEREF n)
+{
+ if ((n == NONE) || (n == ALL)) return;
+ T(free_trie)(t,t->tnodes[n].sub[0]);
+ T(free_trie)(t,t->tnodes[n].sub[1]);
+ pool_put(&t->pool,n);
+}
+
+/*
+ * Return what a link for a region of rlen bits should hold to make
+ *  a/len (which must lie within the region) present and nothing else:
+ *  ALL if the block is the whole region, otherwise a full TNODE.
+ */
+static NODEREF T(trie_leaf)(T(TRIE) *t, W_KEY a, int len, int rlen)
+{
+ NODEREF n;
+
+ if (len == rlen) return(ALL);
+ n = T(new_tnode)(t,a,len);
+ t->tnodes[n].sub[0] = ALL;
+ t->tnodes[n].sub[1] = ALL;
+ return(n);
+}
+
+/*
+ * Add the block a/len to the subtrie n, whose link is responsible for
+ *  a region rlen bits long (which a/len is within).  Like add_to_node,
+ *  this returns what should replace n.
+ *
+ * Algorithm: find how far a and n's prefix agree, cl, capped at both
+ *  lengths.  Then there are three cases.  If n's whole prefix agrees,
+ *  the block is at or under n: if n is full there's nothing to do, if
+ *  the block is exactly n it replaces n's subtrie, and otherwise we
+ *  recurse down the appropriate sub[] link and, if that leaves n full
+ *  and filling its region, collapse it.  If instead the block's whole
+ *  prefix agrees, the block contains n, and simply replaces it.
+ *  Otherwise the two diverge at bit cl, and we need a new TNODE there
+ *  with n on one side and the block on the other.  In that last case
+ *  n's region has just shrunk to cl+1 bits, so if n is full it may now
+ *  have to become ALL, and if both sides are then ALL, so may the new
+ *  TNODE.
+ */
+static NODEREF T(trie_add)(T(TRIE) *t, NODEREF n, W_KEY a, int len, int rlen)
+{
+ NODEREF s;
+ NODEREF p;
+ int cl;
+ int b;
+
+ if (n == ALL) return(ALL);
+ if (n == NONE) return(T(trie_leaf)(t,a,len,rlen));
+ cl = (a == t->tnodes[n].key) ? W_BITS : W_CLZ(a^t->tnodes[n].key);
+ if (cl > len) cl = len;
+ if (cl >= t->tnodes[n].len)
+  { if (TFULL(t,n)) return(n);
+    if (len == t->tnodes[n].len)
+     { T(free_trie)(t,n);
+       return(T(trie_leaf)(t,a,len,rlen));
+     }
+    b = TBIT(a,t->tnodes[n].len);
+    s = T(trie_add)(t,t->tnodes[n].sub[b],a,len,t->tnodes[n].len+1);
+    t->tnodes[n].sub[b] = s;
+    if (TFULL(t,n) && (t->tnodes[n].len == rlen))
+     { pool_put(&t->pool,n);
+       return(ALL);
+     }
+    return(n);
+  }
+ if (cl == len)
+  { T(free_trie)(t,n);
+    return(T(trie_leaf)(t,a,len,rlen));
+  }
+ b = TBIT(a,cl);
+ if (TFULL(t,n) && (t->tnodes[n].len == cl+1))
+  { pool_put(&t->pool,n);
+    n = ALL;
+  }
+ s = T(trie_leaf)(t,a,len,cl+1);
+ if ((s == ALL) && (n == ALL) && (cl == rlen)) return(ALL);
+ p = T(new_tnode)(t,a,cl);
+ t->tnodes[p].sub[b] = s;
+ t->tnodes[p].sub[!b] = n;
+ return(p);
+}
+
+/*
+ * Dump a subtrie whose link is responsible for the region v/len.
+ *  ALL links and full TNODEs are blocks; anything else we recurse
+ *  through, 0 side first.
+ */
+static void T(dump_trie)(T(TRIE) *t, NODEREF n, W_KEY v, int len, W_FN fn, void *arg)
+{
+ if (n == NONE) return;
+ if (n == ALL)
+  { (*fn)(arg,v,len);
+    return;
+  }
+ v = t->tnodes[n].key;
+ len = t->tnodes[n].len;
+ if (TFULL(t,n))
+  { (*fn)(arg,v,len);
+    return;
+  }
+ if (len >= W_BITS) abort();
+ T(dump_trie)(t,t->tnodes[n].sub[0],v,len+1,fn,arg);
+ T(dump_trie)(t,t->tnodes[n].sub[1],v|((W_KEY)1<<(W_BITS-1-len)),len+1,fn,arg);
+}
+
+/*
+ * The trie engine's entry points.  Merging is done by adding every
+ *  block of the other trie, except when this one is empty, when we
+ *  just take the other over.  Not every instantiation is used in every
+ *  build - with NO_MAIN, nothing makes an IPv6 trie - so the ones that
+ *  may not be are marked as such.
+ */
+static void *T(trie_create)(void) __attribute__((__unused__));
+static void T(trie_merge)(void *, void *) __attribute__((__unused__));
+
+static void *T(trie_create)(void)
+{
+ T(TRIE) *t;
+
+ t = malloc(sizeof(T(TRIE)));
+ if (t == 0) nomem();
+ t->pool.mem = 0;
+ t->pool.size = sizeof(T(TNODE));
+ t->pool.used = 0;
+ t->pool.alloc = 0;
+ t->pool.free = NONE;
+ t->pool.limit = 0;
+ t->pool.map = 0;
+ t->tnodes = 0;
+ t->root = NONE;
+ return(t);
+}
+
+static void T(trie_destroy)(void *set)
+{
+ T(TRIE) *t;
+
+ t = set;
+ pool_release(&t->pool);
+ free(t);
+}
+
+static void T(trie_add_block)(void *set, W_ADDR a, int w)
+{
+ T(TRIE) *t;
+
+ t = set;
+ t->root = T(trie_add)(t,t->root,(W_KEY)a,w,0);
+}
+
+static void T(trie_walk)(void *set, W_FN fn, void *arg)
+{
+ T(TRIE) *t;
+
+ t = set;
+ T(dump_trie)(t,t->root,0,0,fn,arg);
+}
+
+static void T(trie_merge)(void *set, void *from)
+{
+ T(TRIE) *t;
+ T(TRIE) *f;
+ T(TRIE) tmp;
+
+ t = set;
+ f = from;
+ if (t->root == NONE)
+  { tmp = *t;
+    *t = *f;
+    *f = tmp;
+  }
+ else
+  { T(trie_walk)(f,&T(trie_add_block),t);
+  }
+ T(trie_destroy)(f);
+}
+
+#undef TFULL
+#undef TBIT
+#undef TMASK
+#undef T
+#undef W_NAME
+#undef W_BITS
+#undef W_KEY
+#undef W_ADDR
+#undef W_FN
+#undef W_ONES
+#undef W_CLZ
+#undef W_CTZ
+#undef W_LOG2
@@ -0,0 +1,63 @@
+/*
+ * A client for cidr-convert --listen, for the tests.
+ *
+ * Usage: client path
+ *
+ * Connects to the daemon's socket at path, sends it everything on
+ *  stdin, closes our end for writing, and copies whatever comes back
+ *  to stdout until the daemon closes its end too - which it does once
+ *  it's replied to everything we sent.
+ *
+ * Build with something like "cc -O2 -o client client.c"; run.sh does.
+ *
+ * This file is in the public domain.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void put_all(int fd, const char *buf, ssize_t len)
+{
+ ssize_t r;
+
+ while (len > 0)
+  { r = write(fd,buf,len);
+    if (r < 0)
+     { if (errno == EINTR) continue;
+       perror("write");
+       _exit(1);
+     }
+    buf += r;
+    len -= r;
+  }
+}
+
+int main(int, char **);
+int main(int ac, char **av)
+{
+ struct sockaddr_un sa;
+ char buf[65536];
+ ssize_t r;
+ int s;
+
+ if ((ac != 2) || (strlen(av[1]) >= sizeof(sa.sun_path)))
+  { fprintf(stderr,"usage: client path\n");
+    return(1);
+  }
+ memset(&sa,0,sizeof(sa));
+ sa.sun_family = AF_UNIX;
+ strcpy(&sa.sun_path[0],av[1]);
+ s = socket(AF_UNIX,SOCK_STREAM,0);
+ if ((s < 0) || (connect(s,(struct sockaddr *)&sa,sizeof(sa)) < 0))
+  { perror(av[1]);
+    return(1);
+  }
+ while ((r = read(0,&buf[0],sizeof(buf))) > 0) put_all(s,&buf[0],r);
+ shutdown(s,SHUT_WR);
+ while ((r = read(s,&buf[0],sizeof(buf))) > 0) put_all(1,&buf[0],r);
+ return(0);
+}
@@ -0,0 +1,130 @@
+#!/bin/sh
+#
+# Regression tests: builds cidr-convert and runs it on each case, and
+#  complains about any whose output (stdout and stderr together) isn't
+#  what's expected.  Exits nonzero if any failed.  The --listen cases
+#  talk to the daemon with client, built from client.c.
+#
+# Usage: sh run.sh
+#
+# The program goes in $TEST_DIR (default /tmp/cidr-test); $CC and
+#  $CFLAGS are used for the compile, as usual.
+#
+# This file is in the public domain.
+
+cd "`dirname "$0"`"
+D=${TEST_DIR:-/tmp/cidr-test}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+mkdir -p "$D"
+$CC $CFLAGS -pthread -o "$D/cidr-convert" ../cidr-convert.c || exit 1
+$CC $CFLAGS -o "$D/client" client.c || exit 1
+FAILED=0
+
+# check name input expected [arg ...]
+#  Runs $RUN (by default, cidr-convert) with the args, and input on
+#  stdin.
+check()
+{
+  name=$1
+  input=$2
+  expected=$3
+  shift 3
+  got=`printf "$input" | "${RUN:-$D/cidr-convert}" "$@" 2>&1`
+  if [ "$got" != "`printf "$expected"`" ]
+  then
+    echo "$name: FAILED"
+    echo "expected:"
+    printf "$expected"
+    echo "got:"
+    echo "$got"
+    FAILED=1
+  fi
+}
+
+# Blocks that a merge within the budget leaves as two halves of one
+#  block are joined, even though there were already few enough.
+check max-blocks-free-merge '10.0.0.0\n10.0.0.2\n10.0.0.4/30\n' \
+  '10.0.0.0/29\ncidr-convert: 2 addresses covered that weren'"'"'t in the input\n' \
+  --max-blocks=2
+
+# IPv4-mapped and translated blocks are printed in mixed notation, and
+#  nothing else is.
+check v6-mixed '::ffff:1.2.3.4\n64:ff9b::/96\n::fffe:102:304\n64:ff9b:1::1\n' \
+  '::fffe:102:304/128\n::ffff:1.2.3.4/128\n64:ff9b::0.0.0.0/96\n64:ff9b:1::1/128\n'
+
+# Range lookups test partial /24s a word at a time, and stop at the
+#  top of the address space.
+printf '255.255.255.128/25\n255.255.254.0/24\n' > "$D/top"
+check lookup-top '255.255.255.128-255.255.255.255\n255.255.255.127-255.255.255.255\n255.255.254.5-255.255.254.200\n' \
+  '255.255.255.128-255.255.255.255\n255.255.254.5-255.255.254.200\n' \
+  --lookup "$D/top"
+
+# The per-node counts, which --count and --within go by, have to be
+#  right however the tree was built: by add_to_node or (for sorted
+#  input) build_block, with lazy collapsing, by subtract_tree for
+#  --exclude, by combine_node, by union_tree (the -j merge of a file big
+#  enough to be split), and by remove_from_node in the daemon; and
+#  --within has to add up the slots under a block wider than one.
+A='10.0.5.7\n10.0.2.0/23\n10.0.0.200-10.1.0.4\n10.3.4.0/22\n10.2.255.255\n10.0.4.0/24\n'
+AS='10.0.0.200-10.1.0.4\n10.0.2.0/23\n10.0.4.0/24\n10.0.5.7\n10.2.255.255\n10.3.4.0/22\n'
+printf "$A" > "$D/A"
+printf '10.0.0.0/16\n10.3.6.0/23\n' > "$D/B"
+printf '10.0.0.128/25\n10.0.3.0/24\n10.0.255.0/24\n' > "$D/E"
+check count "$A" '66366\n' --count
+check count-sorted "$AS" '66366\n' --count
+check count-within "$A" '65336\n' --within=10.0.0.0/16 --count
+check count-within-sorted "$AS" '1848\n' \
+  --within=10.0.0.0/22 --within=10.3.0.0/16 --count
+check count-lazy "$A" '66366\n' --collapse=lazy --count
+check count-lazy-within "$A" '312\n' --collapse=lazy --within=10.0.0.0/23 --count
+check count-exclude "$A" '65798\n' --exclude="$D/E" --count
+check count-exclude-within "$A" '512\n' --exclude="$D/E" --within=10.0.0.0/22 --count
+check count-xor '' '718\n' --combine=xor --count "$D/A" "$D/B"
+check count-xor-within '' '512\n' --combine=xor --within=10.3.0.0/16 --count "$D/A" "$D/B"
+check count-fanout16-wide "$A" '66366\n' --fanout=16 --within=10.0.0.0/8 --count
+check count-fanout16-whole "$A" '66366\n' --fanout=16 --within=0.0.0.0/0 --count
+awk 'BEGIN { for (i=0;i<20000;i++) print "10." int(i/256)%256 "." i%256 "." (i*7)%256 }' > "$D/J"
+check count-union '' '20000\n' -j 4 --count "$D/J"
+check count-union-within '' '256\n' -j 4 --within=10.1.0.0/16 --count "$D/J"
+rm -f "$D/sock"
+"$D/cidr-convert" --listen="$D/sock" "$D/A" &
+DAEMON=$!
+n=0
+while [ ! -S "$D/sock" ] && [ $n -lt 10 ]
+do
+  sleep 1
+  n=`expr $n + 1`
+done
+RUN=$D/client
+check count-daemon-remove 'remove 10.0.2.0/24 10.0.5.7\nadd 10.9.0.0/16\ncount 10.0.0.0/22\ncount 10.0.0.0/8\ncount\n' \
+  'ok\nok\n568\nok\n131645\nok\n131645\nok\n' "$D/sock"
+RUN=
+kill $DAEMON
+
+# Saved state: what's added after loading is merged with what was
+#  saved, and a state can be loaded from and saved to the same file.
+S=$D/state
+rm -f "$S"
+printf '10.0.0.0/25\n' | "$D/cidr-convert" --save-state="$S" > /dev/null
+check state-load-add '10.0.0.128/25\n' '10.0.0.0/24\n' --load-state="$S"
+check state-same-file '10.0.1.0/24\n' '10.0.0.0/25\n10.0.1.0/24\n' \
+  --load-state="$S" --save-state="$S"
+check state-reload '' '10.0.0.0/25\n10.0.1.0/24\n' --load-state="$S"
+
+# A damaged or foreign state is refused.
+size=`wc -c < "$S"`
+head -c `expr $size - 4` "$S" > "$S.short"
+check state-truncated '' "cidr-convert: $S.short: saved state is corrupt\n" \
+  --load-state="$S.short"
+cp "$S" "$S.flip"
+printf '\377' | dd of="$S.flip" bs=1 seek=72 conv=notrunc 2> /dev/null
+check state-flipped '' "cidr-convert: $S.flip: saved state is corrupt\n" \
+  --load-state="$S.flip"
+cp "$S" "$S.vers"
+printf '\377' | dd of="$S.vers" bs=1 seek=8 conv=notrunc 2> /dev/null
+check state-version '' \
+  "cidr-convert: $S.vers: saved state in a format (or byte order) this version can't read\n" \
+  --load-state="$S.vers"
+
+exit $FAILED